@@ -0,0 +1,430 @@
+#include "huffman.h"
+#include "perf_counters.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Corpus = std::vector<uint8_t>;
+
+// Random numbers come straight from mt19937_64, whose output is fixed by
+// the standard, rather than from the distributions, which are not: the
+// corpora have to be the same on every platform to compare results.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : engine_(seed) {}
+
+  uint64_t next() {
+    return engine_();
+  }
+
+  // Uniform in [0, bound); the bias is negligible for small bounds.
+  uint64_t below(uint64_t bound) {
+    return next() % bound;
+  }
+
+  double unit() {
+    return (next() >> 11) * (1.0 / (1ULL << 53));
+  }
+
+ private:
+  std::mt19937_64 engine_;
+};
+
+void append(Corpus &corpus, const std::string &text) {
+  corpus.insert(corpus.end(), text.begin(), text.end());
+}
+
+Corpus uniform_corpus(size_t size) {
+  Random random(1);
+  Corpus corpus(size);
+  for (auto &byte : corpus) {
+    byte = static_cast<uint8_t>(random.next());
+  }
+  return corpus;
+}
+
+Corpus single_symbol_corpus(size_t size) {
+  return Corpus(size, 'a');
+}
+
+// Words drawn from a vocabulary of 4096 with probability 1 / rank.
+Corpus zipf_text_corpus(size_t size) {
+  Random random(2);
+  std::vector<std::string> words(4096);
+  std::vector<double> cumulative(words.size());
+  double sum = 0;
+  for (size_t rank = 0; rank < words.size(); ++rank) {
+    size_t length = 1 + random.below(3) + random.below(6);
+    for (size_t i = 0; i < length; ++i) {
+      words[rank] += static_cast<char>('a' + random.below(26));
+    }
+    sum += 1.0 / (rank + 1);
+    cumulative[rank] = sum;
+  }
+
+  Corpus corpus;
+  corpus.reserve(size + 16);
+  for (size_t i = 1; corpus.size() < size; ++i) {
+    double point = random.unit() * sum;
+    size_t rank = std::lower_bound(cumulative.begin(), cumulative.end(),
+                                   point) - cumulative.begin();
+    append(corpus, words[std::min(rank, words.size() - 1)]);
+    corpus.push_back(i % 12 ? ' ' : '\n');
+  }
+  corpus.resize(size);
+  return corpus;
+}
+
+Corpus log_corpus(size_t size) {
+  static const char *const LEVELS[] = {"INFO", "INFO", "INFO", "DEBUG",
+                                       "WARN", "ERROR"};
+  static const char *const PATHS[] = {"/api/v1/items", "/api/v1/users",
+                                      "/api/v2/orders", "/healthz",
+                                      "/static/app.js"};
+  static const int STATUSES[] = {200, 200, 200, 200, 201, 304, 404, 500};
+  Random random(3);
+  Corpus corpus;
+  corpus.reserve(size + 256);
+  uint64_t millis = 1700000000000ULL;
+  char line[256];
+  while (corpus.size() < size) {
+    millis += random.below(50);
+    uint64_t seconds = millis / 1000;
+    int length = snprintf(
+        line, sizeof line,
+        "2024-05-%02d %02d:%02d:%02d.%03d %-5s [worker-%d] %s/%d "
+        "status=%d latency_ms=%d client=10.0.%d.%d\n",
+        static_cast<int>(seconds / 86400 % 28 + 1),
+        static_cast<int>(seconds / 3600 % 24),
+        static_cast<int>(seconds / 60 % 60), static_cast<int>(seconds % 60),
+        static_cast<int>(millis % 1000),
+        LEVELS[random.below(sizeof LEVELS / sizeof *LEVELS)],
+        static_cast<int>(random.below(8)),
+        PATHS[random.below(sizeof PATHS / sizeof *PATHS)],
+        static_cast<int>(random.below(100000)),
+        STATUSES[random.below(sizeof STATUSES / sizeof *STATUSES)],
+        static_cast<int>(random.below(20) * random.below(20)),
+        static_cast<int>(random.below(4)),
+        static_cast<int>(random.below(256)));
+    corpus.insert(corpus.end(), line, line + length);
+  }
+  corpus.resize(size);
+  return corpus;
+}
+
+// Machine-code-like data: skewed opcode bytes, little-endian words with
+// mostly zero high bytes, zero padding and the odd string table.
+Corpus binary_corpus(size_t size) {
+  static const uint8_t OPCODES[] = {0x48, 0x89, 0x8B, 0xE8, 0x83, 0xC3,
+                                    0x0F, 0x85, 0x74, 0x31, 0xFF, 0x4C};
+  Random random(4);
+  Corpus corpus;
+  corpus.reserve(size + 64);
+  while (corpus.size() < size) {
+    uint64_t kind = random.below(16);
+    if (kind < 10) {
+      corpus.push_back(OPCODES[random.below(random.below(12) + 1)]);
+      corpus.push_back(static_cast<uint8_t>(0xC0 | random.below(64)));
+    } else if (kind < 14) {
+      uint32_t word = static_cast<uint32_t>(random.below(1 << 12));
+      for (int i = 0; i < 4; ++i) {
+        corpus.push_back(static_cast<uint8_t>(word >> 8 * i));
+      }
+    } else if (kind < 15) {
+      corpus.insert(corpus.end(), random.below(32), 0);
+    } else {
+      append(corpus, "_ZNSt6vector");
+      corpus.push_back(static_cast<uint8_t>('0' + random.below(10)));
+      corpus.push_back(0);
+    }
+  }
+  corpus.resize(size);
+  return corpus;
+}
+
+// Output of the archiver itself on text, which leaves it nothing to gain.
+Corpus compressed_corpus(size_t size) {
+  Corpus text = zipf_text_corpus(2 * size + 1024);
+  huff::HuffmanArchiver huffman_archiver;
+  Corpus corpus(huffman_archiver.encode_bound(text.size()));
+  size_t encoded_size;
+  huffman_archiver.encode(text.data(), text.size(), corpus.data(),
+                          corpus.size(), encoded_size);
+  corpus.resize(encoded_size);
+  while (corpus.size() < size) {
+    corpus.insert(corpus.end(), corpus.begin(), corpus.end());
+  }
+  corpus.resize(size);
+  return corpus;
+}
+
+using huff::PerfCounters;
+
+struct Timing {
+  double median;
+  double p99;
+  unsigned runs;
+  uint64_t counts[PerfCounters::COUNTERS];
+};
+
+// Runs the phase the given number of times. The 99th percentile is taken
+// by nearest rank, so with fewer than 100 runs it is the slowest one. The
+// counters are summed over the runs; they are started outside the timed
+// span so that their system calls don't count as the phase's time.
+Timing measure(PerfCounters &counters, unsigned runs,
+               const std::function<void()> &phase) {
+  Timing timing = Timing();
+  timing.runs = runs;
+  std::vector<double> seconds;
+  for (unsigned run = 0; run < runs; ++run) {
+    counters.start();
+    auto begin = std::chrono::steady_clock::now();
+    phase();
+    auto end = std::chrono::steady_clock::now();
+    counters.stop();
+    seconds.push_back(std::chrono::duration<double>(end - begin).count());
+    for (int counter = 0; counter < PerfCounters::COUNTERS; ++counter) {
+      timing.counts[counter] +=
+          counters.value(static_cast<PerfCounters::Counter>(counter));
+    }
+  }
+  std::sort(seconds.begin(), seconds.end());
+  size_t p99_rank = static_cast<size_t>(std::ceil(0.99 * seconds.size()));
+  timing.median = seconds[seconds.size() / 2];
+  timing.p99 = seconds[p99_rank - 1];
+  return timing;
+}
+
+// Writes numerator / denominator, or null when either counter is missing.
+void print_ratio(std::ostream &out, const char *name, double numerator,
+                 double denominator, bool available) {
+  out << ", \"" << name << "\": ";
+  if (available && denominator > 0) {
+    out << numerator / denominator;
+  } else {
+    out << "null";
+  }
+}
+
+// Counters are given as averages per run, and the rates derived from them
+// as cycles per byte, instructions per cycle and the share of mispredicted
+// branches.
+void print_counters(std::ostream &out, const PerfCounters &counters,
+                    const Timing &timing, size_t bytes) {
+  out << ", \"counters\": {";
+  for (int counter = 0; counter < PerfCounters::COUNTERS; ++counter) {
+    out << (counter ? ", \"" : "\"") << PerfCounters::NAMES[counter]
+        << "\": ";
+    if (counters.available(static_cast<PerfCounters::Counter>(counter))) {
+      out << timing.counts[counter] / timing.runs;
+    } else {
+      out << "null";
+    }
+  }
+  const uint64_t *counts = timing.counts;
+  print_ratio(out, "cycles_per_byte",
+              static_cast<double>(counts[PerfCounters::CYCLES]) / timing.runs,
+              static_cast<double>(bytes),
+              counters.available(PerfCounters::CYCLES));
+  print_ratio(out, "ipc",
+              static_cast<double>(counts[PerfCounters::INSTRUCTIONS]),
+              static_cast<double>(counts[PerfCounters::CYCLES]),
+              counters.available(PerfCounters::INSTRUCTIONS) &&
+                  counters.available(PerfCounters::CYCLES));
+  print_ratio(out, "branch_miss_rate",
+              static_cast<double>(counts[PerfCounters::BRANCH_MISSES]),
+              static_cast<double>(counts[PerfCounters::BRANCHES]),
+              counters.available(PerfCounters::BRANCH_MISSES) &&
+                  counters.available(PerfCounters::BRANCHES));
+  out << "}";
+}
+
+void print_phase(std::ostream &out, const PerfCounters &counters,
+                 const char *name, const Timing &timing, size_t bytes,
+                 bool last) {
+  double megabytes = bytes / 1e6;
+  out << "        \"" << name << "\": {"
+      << "\"median_s\": " << timing.median << ", "
+      << "\"p99_s\": " << timing.p99 << ", "
+      << "\"median_mb_s\": " << megabytes / timing.median << ", "
+      << "\"p99_mb_s\": " << megabytes / timing.p99;
+  if (counters.any_available()) {
+    print_counters(out, counters, timing, bytes);
+  }
+  out << "}" << (last ? "\n" : ",\n");
+}
+
+// Benchmarks one corpus and prints its JSON object. Decoding is timed
+// with every engine; the check guards against timing a broken decoder.
+void bench_corpus(std::ostream &out, PerfCounters &counters,
+                  const std::string &name, const Corpus &corpus,
+                  unsigned runs) {
+  huff::HuffmanArchiver huffman_archiver;
+  uint32_t counts[256];
+  Timing histogram = measure(counters, runs, [&]() {
+    std::fill(counts, counts + 256, 0);
+    huff::histogram(corpus.data(), corpus.size(), counts);
+  });
+
+  Timing build = measure(counters, runs, [&]() {
+    huff::HuffTree huff_tree;
+    huff_tree.build_tree(counts);
+    huff_tree.limit_code_lengths(huffman_archiver.max_code_length());
+    huff_tree.extract_codes();
+  });
+
+  std::vector<uint8_t> encoded(huffman_archiver.encode_bound(corpus.size()));
+  size_t encoded_size = 0;
+  Timing encode = measure(counters, runs, [&]() {
+    huffman_archiver.encode(corpus.data(), corpus.size(), encoded.data(),
+                            encoded.size(), encoded_size);
+  });
+
+  static const std::pair<const char *, huff::HuffmanArchiver::DecodeEngine>
+      ENGINES[] = {{"decode_tree", huff::HuffmanArchiver::TREE_WALK},
+                   {"decode_table", huff::HuffmanArchiver::TABLE},
+                   {"decode_multi", huff::HuffmanArchiver::MULTI_SYMBOL},
+                   {"decode_byte", huff::HuffmanArchiver::BYTE_TABLE},
+                   {"decode_auto", huff::HuffmanArchiver::AUTO}};
+  std::vector<uint8_t> decoded(corpus.size());
+  std::vector<Timing> decode;
+  for (auto &engine : ENGINES) {
+    huffman_archiver.decode_engine(engine.second);
+    size_t decoded_size = 0;
+    decode.push_back(measure(counters, runs, [&]() {
+      huffman_archiver.decode(encoded.data(), encoded_size, decoded.data(),
+                              decoded.size(), decoded_size);
+    }));
+    if (decoded_size != corpus.size() || decoded != corpus) {
+      throw std::runtime_error(std::string("Decoding failed: ") +
+                               engine.first + " on " + name);
+    }
+  }
+
+  out << "    {\n"
+      << "      \"corpus\": \"" << name << "\",\n"
+      << "      \"size\": " << corpus.size() << ",\n"
+      << "      \"encoded_size\": " << encoded_size << ",\n"
+      << "      \"ratio\": "
+      << static_cast<double>(encoded_size) / std::max<size_t>(corpus.size(), 1)
+      << ",\n"
+      << "      \"phases\": {\n";
+  print_phase(out, counters, "histogram", histogram, corpus.size(), false);
+  print_phase(out, counters, "build_tree", build, corpus.size(), false);
+  print_phase(out, counters, "encode", encode, corpus.size(), false);
+  for (size_t i = 0; i < decode.size(); ++i) {
+    print_phase(out, counters, ENGINES[i].first, decode[i], corpus.size(),
+                i + 1 == decode.size());
+  }
+  out << "      }\n"
+      << "    }";
+}
+
+std::vector<size_t> parse_sizes(const char *list) {
+  std::vector<size_t> sizes;
+  std::istringstream in(list);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    char *end;
+    unsigned long size = strtoul(item.c_str(), &end, 10);
+    if (*end == 'K' || *end == 'M') {
+      int shift = *end++ == 'K' ? 10 : 20;
+      if (size > (ULONG_MAX >> shift)) {
+        throw std::runtime_error("Wrong corpus size!");
+      }
+      size <<= shift;
+    }
+    if (*end || size == 0) {
+      throw std::runtime_error("Wrong corpus size!");
+    }
+    sizes.push_back(size);
+  }
+  return sizes;
+}
+
+} //namespace
+
+// Prints the results as one JSON document on stdout; progress and errors
+// go to stderr.
+int main(int argc, char **argv) {
+  try {
+    unsigned runs = 5;
+    std::vector<size_t> sizes = {64 << 10, 1 << 20, 16 << 20};
+    for (int argi = 1; argi < argc; ++argi) {
+      if (argi + 1 == argc) {
+        throw std::runtime_error("Wrong arguments!");
+      }
+      if (!strcmp(argv[argi], "-r") || !strcmp(argv[argi], "--runs")) {
+        char *end;
+        unsigned long count = strtoul(argv[++argi], &end, 10);
+        if (*end || count == 0 || count > 1000) {
+          throw std::runtime_error("Wrong number of runs!");
+        }
+        runs = static_cast<unsigned>(count);
+        continue;
+      }
+      if (!strcmp(argv[argi], "-s") || !strcmp(argv[argi], "--sizes")) {
+        sizes = parse_sizes(argv[++argi]);
+        continue;
+      }
+      throw std::runtime_error("Wrong arguments!");
+    }
+
+    static const std::pair<const char *, Corpus (*)(size_t)> CORPORA[] = {
+        {"uniform", uniform_corpus},
+        {"zipf_text", zipf_text_corpus},
+        {"single_symbol", single_symbol_corpus},
+        {"log", log_corpus},
+        {"binary", binary_corpus},
+        {"compressed", compressed_corpus}};
+
+    PerfCounters counters;
+    std::cout << std::setprecision(6)
+              << "{\n"
+              << "  \"format_version\": "
+              << static_cast<int>(huff::HuffmanArchiver::VERSION) << ",\n"
+              << "  \"runs\": " << runs << ",\n"
+              << "  \"perf_counters\": [";
+    bool first = true;
+    for (int counter = 0; counter < PerfCounters::COUNTERS; ++counter) {
+      if (counters.available(static_cast<PerfCounters::Counter>(counter))) {
+        std::cout << (first ? "\"" : ", \"") << PerfCounters::NAMES[counter]
+                  << "\"";
+        first = false;
+      }
+    }
+    std::cout << "],\n"
+              << "  \"results\": [\n";
+    first = true;
+    for (size_t size : sizes) {
+      for (auto &corpus : CORPORA) {
+        std::cerr << corpus.first << " " << size << std::endl;
+        if (!first) {
+          std::cout << ",\n";
+        }
+        first = false;
+        bench_corpus(std::cout, counters, corpus.first, corpus.second(size),
+                     runs);
+      }
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
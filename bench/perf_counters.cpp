@@ -0,0 +1,129 @@
+#include "perf_counters.h"
+
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace huff {
+
+const char *const PerfCounters::NAMES[COUNTERS] = {
+    "cycles", "instructions", "branches", "branch_misses", "l1d_read_misses",
+    "llc_misses", "page_faults"};
+
+#ifdef __linux__
+
+namespace {
+
+int open_counter(uint32_t type, uint64_t config) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof attr);
+  attr.size = sizeof attr;
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+} //namespace
+
+// Every counter is opened on its own, so that a machine lacking one of
+// them still reports the rest.
+PerfCounters::PerfCounters() : values_() {
+  const uint64_t l1d_read_misses =
+      PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+      PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  fds_[CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  fds_[INSTRUCTIONS] =
+      open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  fds_[BRANCHES] =
+      open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS);
+  fds_[BRANCH_MISSES] =
+      open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  fds_[L1D_READ_MISSES] = open_counter(PERF_TYPE_HW_CACHE, l1d_read_misses);
+  fds_[LLC_MISSES] =
+      open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  fds_[PAGE_FAULTS] =
+      open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+}
+
+PerfCounters::~PerfCounters() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+void PerfCounters::start() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void PerfCounters::stop() {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  for (int counter = 0; counter < COUNTERS; ++counter) {
+    uint64_t data[3];
+    values_[counter] = 0;
+    if (fds_[counter] < 0 ||
+        read(fds_[counter], data, sizeof data) != sizeof data) {
+      continue;
+    }
+    values_[counter] = data[2] == 0 || data[2] == data[1]
+                           ? data[0]
+                           : static_cast<uint64_t>(
+                                 static_cast<double>(data[0]) * data[1] /
+                                 data[2]);
+  }
+}
+
+#else
+
+PerfCounters::PerfCounters() : values_() {
+  for (int &fd : fds_) {
+    fd = -1;
+  }
+}
+
+PerfCounters::~PerfCounters() {}
+
+void PerfCounters::start() {}
+
+void PerfCounters::stop() {}
+
+#endif
+
+bool PerfCounters::available(Counter counter) const {
+  return fds_[counter] >= 0;
+}
+
+bool PerfCounters::any_available() const {
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t PerfCounters::value(Counter counter) const {
+  return values_[counter];
+}
+
+} //namespace huff
@@ -0,0 +1,44 @@
+#ifndef HW_02_PERF_COUNTERS_H
+#define HW_02_PERF_COUNTERS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace huff {
+
+// Performance counters of the calling thread, read through Linux
+// perf_event_open. A counter that can't be opened, for lack of permission,
+// in a virtual machine without a PMU or on another system, is reported as
+// unavailable instead of failing.
+class PerfCounters {
+ public:
+  enum Counter {
+    CYCLES, INSTRUCTIONS, BRANCHES, BRANCH_MISSES, L1D_READ_MISSES,
+    LLC_MISSES, PAGE_FAULTS, COUNTERS
+  };
+
+  static const char *const NAMES[COUNTERS];
+
+  PerfCounters();
+  PerfCounters(const PerfCounters &other) = delete;
+  PerfCounters &operator=(const PerfCounters &other) = delete;
+  ~PerfCounters();
+
+  bool available(Counter counter) const;
+  bool any_available() const;
+
+  void start();
+  void stop();
+
+  // Events counted between the last start and stop, scaled up when the
+  // kernel had to multiplex the counter.
+  uint64_t value(Counter counter) const;
+
+ private:
+  int fds_[COUNTERS];
+  uint64_t values_[COUNTERS];
+};
+
+} //namespace huff
+
+#endif //HW_02_PERF_COUNTERS_H
@@ -1,22 +1,62 @@
 #include "huffman.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
 #include <iostream>
 #include <cstring>
 
 namespace huff {
 
+//=================================Histogram=================================//
+
+namespace {
+
+const int SUB_HISTOGRAMS = 4;
+
+} //namespace
+
+// Consecutive bytes go to different sub-histograms, so runs of the same
+// byte do not stall on incrementing one counter over and over.
+void histogram(const uint8_t *data, size_t size, uint32_t counts[256]) {
+  uint32_t sub_counts[SUB_HISTOGRAMS][256] = {};
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    uint64_t first, second;
+    memcpy(&first, data + i, sizeof first);
+    memcpy(&second, data + i + 8, sizeof second);
+    for (int j = 0; j < 64; j += 16) {
+      ++sub_counts[0][(first >> j) & 0xFF];
+      ++sub_counts[1][(first >> (j + 8)) & 0xFF];
+      ++sub_counts[2][(second >> j) & 0xFF];
+      ++sub_counts[3][(second >> (j + 8)) & 0xFF];
+    }
+  }
+  for (; i < size; ++i) {
+    ++sub_counts[i % SUB_HISTOGRAMS][data[i]];
+  }
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    for (int k = 0; k < SUB_HISTOGRAMS; ++k) {
+      counts[symbol] += sub_counts[k][symbol];
+    }
+  }
+}
+
+//=================================Histogram=================================//
+
 //==================================TreeNode=================================//
 
 TreeNode::TreeNode()
     : used_(false), type_(EMPTY), symbol_(0), amount_(0),
       left_(nullptr), right_(nullptr) {}
 
-TreeNode::TreeNode(char symbol, uint32_t amount)
+TreeNode::TreeNode(char symbol, uint64_t amount)
     : used_(false), type_(EXTERNAL), symbol_(symbol), amount_(amount),
       left_(nullptr), right_(nullptr) {}
 
-TreeNode::TreeNode(std::pair<const char, uint32_t> sym_am)
+TreeNode::TreeNode(std::pair<const char, uint64_t> sym_am)
     : used_(false), type_(EXTERNAL), symbol_(sym_am.first),
       amount_(sym_am.second), left_(nullptr), right_(nullptr) {}
 
@@ -64,7 +104,7 @@ char TreeNode::symbol() const {
   return symbol_;
 }
 
-uint32_t TreeNode::amount() const {
+uint64_t TreeNode::amount() const {
   return amount_;
 }
 
@@ -88,39 +128,163 @@ const TreeNode *TreeNode::right() const {
 
 //=================================BitWriter=================================//
 
-BitWriter::BitWriter(std::ostream &out) : buffer_(0), size_(0), out_(out) {}
+const size_t BitWriter::OUT_BUFFER_SIZE;
+
+BitWriter::BitWriter(std::ostream &out)
+    : buffer_(0), size_(0), own_buffer_(OUT_BUFFER_SIZE),
+      out_buffer_(own_buffer_.data()), out_capacity_(OUT_BUFFER_SIZE),
+      out_size_(0), out_(&out) {}
+
+BitWriter::BitWriter(uint8_t *data, size_t size)
+    : buffer_(0), size_(0), out_buffer_(data), out_capacity_(size),
+      out_size_(0), out_(nullptr) {}
 
 void BitWriter::write(const BitBuffer &bit_buffer) {
-  int loop_count = bit_buffer.size / 8;
-  for (int i = 0; i < loop_count; ++i) {
-    buffer_ |= static_cast<uint16_t>(bit_buffer.buffer[i]) << size_;
-    out_.write(reinterpret_cast<char *>(&buffer_), sizeof(char));
-    buffer_ >>= 8;
-  }
-  int residue = bit_buffer.size % 8;
-  if (residue) {
-    buffer_ |= static_cast<uint16_t>(bit_buffer.buffer[loop_count] &
-                                     ((1UL << residue) - 1)) << size_;
-    size_ += residue;
-    if (size_ > 7) {
-      out_.write(reinterpret_cast<char *>(&buffer_), sizeof(char));
-      buffer_ >>= 8;
-      size_ -= 8;
+  for (int i = 0; i < bit_buffer.size; i += 64) {
+    uint64_t bits = 0;
+    for (int j = 0; j < 8 && i / 8 + j < 32; ++j) {
+      bits |= static_cast<uint64_t>(bit_buffer.buffer[i / 8 + j]) << 8 * j;
     }
+    uint8_t size = std::min(bit_buffer.size - i, 64);
+    if (size < 64) {
+      bits &= (1ULL << size) - 1;
+    }
+    write(bits, size);
+  }
+}
+
+// The accumulator always holds fewer than 64 bits between calls; once it
+// fills up, all 8 bytes are stored at once and the rest of the code stays.
+void BitWriter::write(uint64_t bits, uint8_t size) {
+  buffer_ |= bits << size_;
+  size_ += size;
+  if (size_ >= 64) {
+    store();
+    size_ -= 64;
+    buffer_ = size_ ? bits >> (size - size_) : 0;
   }
 }
 
 void BitWriter::flush() {
-  if (size_ == 0) {
-    return;
+  for (; size_ > 0; size_ -= std::min<uint8_t>(size_, 8)) {
+    if (out_size_ == out_capacity_) {
+      drain();
+    }
+    out_buffer_[out_size_++] = static_cast<uint8_t>(buffer_);
+    buffer_ >>= 8;
+  }
+  buffer_ = 0;
+  if (out_) {
+    drain();
   }
-  out_.write(reinterpret_cast<char *>(&buffer_), sizeof(char));
-  buffer_ >>= 8;
-  size_ = 0;
+}
+
+void BitWriter::store() {
+  if (out_size_ + sizeof buffer_ > out_capacity_) {
+    drain();
+  }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&out_buffer_[out_size_], &buffer_, sizeof buffer_);
+#else
+  for (size_t i = 0; i < sizeof buffer_; ++i) {
+    out_buffer_[out_size_ + i] = static_cast<uint8_t>(buffer_ >> 8 * i);
+  }
+#endif
+  out_size_ += sizeof buffer_;
+}
+
+// A writer over caller memory is given the exact size of its output, so
+// running out of room there means the size was computed wrong.
+void BitWriter::drain() {
+  if (!out_) {
+    throw std::logic_error("BitWriter overflow!");
+  }
+  out_->write(reinterpret_cast<char *>(out_buffer_), out_size_);
+  out_size_ = 0;
 }
 
 //=================================BitWriter=================================//
 
+//=================================BitReader=================================//
+
+const uint8_t BitReader::MAX_PEEK_BITS;
+
+BitReader::BitReader()
+    : cur_(nullptr), end_(nullptr), buffer_(0), size_(0), padding_(0) {}
+
+BitReader::BitReader(const uint8_t *data, size_t size)
+    : cur_(data), end_(data + size), buffer_(0), size_(0), padding_(0) {}
+
+uint64_t BitReader::peek(uint8_t size) {
+  if (size_ < size) {
+    refill();
+  }
+  return buffer_ & ((1ULL << size) - 1);
+}
+
+void BitReader::consume(uint8_t size) {
+  buffer_ >>= size;
+  size_ -= size;
+}
+
+bool BitReader::overrun() const {
+  return padding_ > size_;
+}
+
+// Away from the end of the data the next 8 bytes are loaded at once and
+// shifted in above the bits already held. Only the bytes that fit whole
+// are counted as read: the low bits of a byte that only partly fits are
+// loaded again, into the same place, by the next refill. The last bytes
+// and the zero padding past them are shifted in one at a time.
+void BitReader::refill() {
+  if (end_ - cur_ >= 8) {
+    uint64_t word = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&word, cur_, sizeof word);
+#else
+    for (size_t i = 0; i < sizeof word; ++i) {
+      word |= static_cast<uint64_t>(cur_[i]) << 8 * i;
+    }
+#endif
+    buffer_ |= word << size_;
+    cur_ += (63 - size_) >> 3;
+    size_ |= 56;
+    return;
+  }
+  while (size_ <= 56) {
+    uint64_t byte = 0;
+    if (cur_ < end_) {
+      byte = *cur_++;
+    } else {
+      padding_ += 8;
+    }
+    buffer_ |= byte << size_;
+    size_ += 8;
+  }
+}
+
+//=================================BitReader=================================//
+
+//=================================CodeTable=================================//
+
+const uint8_t CodeTable::MAX_CODE_SIZE;
+
+CodeTable::CodeTable() : table_() {}
+
+void CodeTable::set(uint8_t symbol, uint64_t bits, uint8_t size) {
+  table_[symbol] = bits | static_cast<uint64_t>(size) << MAX_CODE_SIZE;
+}
+
+uint64_t CodeTable::bits(uint8_t symbol) const {
+  return table_[symbol] & ((1ULL << MAX_CODE_SIZE) - 1);
+}
+
+uint8_t CodeTable::size(uint8_t symbol) const {
+  return table_[symbol] >> MAX_CODE_SIZE;
+}
+
+//=================================CodeTable=================================//
+
 //==================================HuffTree=================================//
 
 BitBuffer::BitBuffer(uint16_t size) : size(size), buffer() {
@@ -136,7 +300,12 @@ BitBuffer &BitBuffer::operator=(const BitBuffer &other) {
   return *this;
 }
 
-HuffTree::HuffTree(std::map<char, uint32_t> &amount_table) {
+const uint8_t HuffTree::MIN_LENGTH_LIMIT;
+const uint8_t HuffTree::MAX_CODE_LENGTH;
+
+HuffTree::HuffTree() : code_lengths_() {}
+
+HuffTree::HuffTree(std::map<char, uint64_t> &amount_table) : code_lengths_() {
   build_tree(amount_table);
   try {
     extract_codes();
@@ -145,6 +314,15 @@ HuffTree::HuffTree(std::map<char, uint32_t> &amount_table) {
   }
 }
 
+HuffTree::HuffTree(const CodeLengths &code_lengths) : code_lengths_() {
+  build_canonical_tree(code_lengths);
+  try {
+    extract_codes();
+  } catch (const std::logic_error &e) {
+    return;
+  }
+}
+
 HuffTree::HuffTree(const HuffTree &other) {
   *this = other;
 }
@@ -153,14 +331,19 @@ HuffTree &HuffTree::operator=(const HuffTree &other) {
   if (this == &other) {
     return *this;
   }
-  std::map<char, uint32_t> amount_table;
+  tree_.clear();
+  tree_.reserve(other.tree_.size());
+  const TreeNode *other_begin = other.tree_.data();
   for (auto &elem : other.tree_) {
-    if (elem.type() == TreeNode::EXTERNAL) {
-      amount_table[elem.symbol()] = elem.amount();
+    if (elem.type() == TreeNode::INTERNAL) {
+      tree_.emplace_back(&tree_[elem.left() - other_begin],
+                         &tree_[elem.right() - other_begin]);
+    } else {
+      tree_.push_back(elem);
     }
   }
-  build_tree(amount_table);
-  char_buffer_map_ = other.char_buffer_map_;
+  code_lengths_ = other.code_lengths_;
+  code_table_ = other.code_table_;
   return *this;
 }
 
@@ -174,80 +357,391 @@ uint8_t HuffTree::leaves_count() const {
   return (tree_.size() - 1) / 2;
 }
 
-void HuffTree::build_tree(std::map<char, uint32_t> &amount_table) {
+const CodeLengths &HuffTree::code_lengths() const {
+  return code_lengths_;
+}
+
+uint8_t HuffTree::max_code_length() const {
+  return *std::max_element(code_lengths_.begin(), code_lengths_.end());
+}
+
+// Exact size of the payload coding the histogram with these lengths.
+uint64_t HuffTree::encoded_bits(const uint32_t counts[256],
+                                const CodeLengths &code_lengths) {
+  uint64_t bits = 0;
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    bits += static_cast<uint64_t>(counts[symbol]) * code_lengths[symbol];
+  }
+  return bits;
+}
+
+uint64_t HuffTree::encoded_bits(const uint32_t counts[256]) const {
+  return encoded_bits(counts, code_lengths_);
+}
+
+void HuffTree::build_tree(std::map<char, uint64_t> &amount_table) {
   tree_.clear();
   tree_.reserve(2 * amount_table.size());
   for (auto &elem : amount_table) {
     tree_.emplace_back(elem);
   }
-  int loop_count = static_cast<int>(tree_.size()) - 1;
-  for (int i = 0; i < loop_count; ++i) {
-    TreeNode *first_min = &*std::min_element(tree_.begin(), tree_.end());
-    first_min->used(true);
-    TreeNode *second_min = &*std::min_element(tree_.begin(), tree_.end());
+  merge_leaves();
+}
+
+void HuffTree::build_tree(const uint32_t counts[256]) {
+  uint64_t wide_counts[256];
+  std::copy(counts, counts + 256, wide_counts);
+  build_tree(wide_counts);
+}
+
+void HuffTree::build_tree(const uint64_t counts[256]) {
+  tree_.clear();
+  tree_.reserve(2 * 256);
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    if (counts[symbol]) {
+      tree_.emplace_back(static_cast<char>(symbol), counts[symbol]);
+    }
+  }
+  merge_leaves();
+}
+
+// Two-queue construction: once the leaves are sorted, parents are created
+// in non-decreasing order of amount, so both the remaining leaves and the
+// parents form sorted queues and the two smallest nodes are at their heads.
+// Ties between leaves are broken by symbol, so the tree is deterministic.
+void HuffTree::merge_leaves() {
+  std::sort(tree_.begin(), tree_.end(),
+            [](const TreeNode &first, const TreeNode &second) {
+              return std::make_pair(first.amount(), first.symbol()) <
+                     std::make_pair(second.amount(), second.symbol());
+            });
+  size_t leaves = tree_.size();
+  size_t next_leaf = 0;
+  size_t next_parent = leaves;
+  auto pop_min = [&]() {
+    if (next_leaf < leaves &&
+        (next_parent == tree_.size() ||
+         tree_[next_leaf].amount() <= tree_[next_parent].amount())) {
+      return &tree_[next_leaf++];
+    }
+    return &tree_[next_parent++];
+  };
+  for (size_t i = 1; i < leaves; ++i) {
+    TreeNode *first_min = pop_min();
+    TreeNode *second_min = pop_min();
     tree_.emplace_back(first_min, second_min);
   }
+
+  code_lengths_.fill(0);
+  code_table_ = CodeTable();
+  if (!tree_.empty()) {
+    extract_lengths_rec(&tree_.back(), 0);
+  }
 }
 
-void HuffTree::save_tree_info(std::ostream &out) const {
-  emptiness_check();
-  uint8_t leaves = leaves_count();
-  out.write(reinterpret_cast<char *>(&leaves), sizeof leaves);
-  uint32_t bit_sum = 0;
+// Rebuilds the tree of the canonical code with the given lengths. Leaves
+// take the smallest codes of their level, so every level is laid out as its
+// leaves in symbol order followed by parents of the level below. The codes
+// are extracted right away, so that no codes of an earlier tree survive.
+void HuffTree::build_canonical_tree(const CodeLengths &code_lengths,
+                                    const uint64_t *counts) {
+  tree_.clear();
+  code_lengths_.fill(0);
+  code_table_ = CodeTable();
+
+  size_t leaves = 0;
+  uint8_t max_length = 0;
+  for (auto length : code_lengths) {
+    if (length > MAX_CODE_LENGTH) {
+      throw std::runtime_error("File format error!");
+    }
+    leaves += length > 0;
+    max_length = std::max(max_length, length);
+  }
+  if (leaves == 0) {
+    return;
+  }
+  tree_.reserve(2 * leaves);
+  if (leaves == 1) {
+    for (int symbol = 0; symbol < 256; ++symbol) {
+      if (code_lengths[symbol]) {
+        tree_.emplace_back(static_cast<char>(symbol),
+                           counts ? counts[symbol] : 0);
+      }
+    }
+    code_lengths_ = code_lengths;
+    extract_codes();
+    return;
+  }
+
+  size_t level_begin = 0;
+  size_t level_end = 0;
+  for (int length = max_length; length > 0; --length) {
+    size_t children_begin = level_begin;
+    size_t children_end = level_end;
+    if ((children_end - children_begin) % 2) {
+      tree_.clear();
+      throw std::runtime_error("File format error!");
+    }
+    level_begin = tree_.size();
+    for (int symbol = 0; symbol < 256; ++symbol) {
+      if (code_lengths[symbol] == length) {
+        tree_.emplace_back(static_cast<char>(symbol),
+                           counts ? counts[symbol] : 0);
+      }
+    }
+    for (size_t i = children_begin; i < children_end; i += 2) {
+      tree_.emplace_back(&tree_[i], &tree_[i + 1]);
+    }
+    level_end = tree_.size();
+  }
+  if (level_end - level_begin != 2) {
+    tree_.clear();
+    throw std::runtime_error("File format error!");
+  }
+  tree_.emplace_back(&tree_[level_begin], &tree_[level_begin + 1]);
+  code_lengths_ = code_lengths;
+  extract_codes();
+}
+
+// Replaces the code lengths with optimal ones no longer than max_length,
+// found by package-merge. Each level lists the leaves merged with packages
+// of item pairs from the level below; a leaf gets one bit for every level
+// where it is among the 2n - 2 cheapest items taken from that level.
+void HuffTree::limit_code_lengths(uint8_t max_length) {
+  if (tree_.empty() || max_code_length() <= max_length) {
+    return;
+  }
+  if (max_length < MIN_LENGTH_LIMIT || max_length > MAX_CODE_LENGTH) {
+    throw std::logic_error("Wrong code length limit!");
+  }
+
+  struct Item {
+    uint64_t weight;
+    int leaf;
+  };
+  std::vector<Item> leaves;
+  uint64_t counts[256] = {};
   for (auto &node : tree_) {
     if (node.type() == TreeNode::EXTERNAL) {
-      char symbol = node.symbol();
-      uint32_t amount = node.amount();
-      bit_sum += amount * char_buffer_map_.at(symbol).size;
-      out.write(&symbol, sizeof symbol);
-      out.write(reinterpret_cast<char *>(&amount), sizeof amount);
+      uint8_t symbol = static_cast<uint8_t>(node.symbol());
+      counts[symbol] = node.amount();
+      leaves.push_back(Item{node.amount(), symbol});
     }
   }
-  bit_sum %= 8;
-  if (tree_.size() != 1) {
-    out.write(reinterpret_cast<char *>(&bit_sum), sizeof(char));
+  std::sort(leaves.begin(), leaves.end(),
+            [](const Item &first, const Item &second) {
+              return first.weight < second.weight;
+            });
+
+  std::vector<std::vector<Item>> levels(max_length);
+  levels[max_length - 1] = leaves;
+  for (int level = max_length - 2; level >= 0; --level) {
+    const std::vector<Item> &below = levels[level + 1];
+    std::vector<Item> packages;
+    for (size_t i = 0; i + 1 < below.size(); i += 2) {
+      packages.push_back(Item{below[i].weight + below[i + 1].weight, -1});
+    }
+    levels[level].resize(leaves.size() + packages.size());
+    std::merge(leaves.begin(), leaves.end(), packages.begin(), packages.end(),
+               levels[level].begin(),
+               [](const Item &first, const Item &second) {
+                 return first.weight < second.weight;
+               });
+  }
+
+  CodeLengths code_lengths = {};
+  size_t take = 2 * leaves.size() - 2;
+  for (int level = 0; level < max_length; ++level) {
+    size_t packages = 0;
+    for (size_t i = 0; i < take; ++i) {
+      if (levels[level][i].leaf < 0) {
+        ++packages;
+      } else {
+        ++code_lengths[levels[level][i].leaf];
+      }
+    }
+    take = 2 * packages;
   }
+  build_canonical_tree(code_lengths, counts);
 }
 
-void HuffTree::extract_codes() {
-  extract_codes(char_buffer_map_);
+size_t HuffTree::tree_info_size(uint8_t max_length) {
+  return 1 + (max_length > 15 ? 256 : 128);
 }
 
-void
-HuffTree::extract_codes(std::map<char, BitBuffer> &char_buffer_map) const {
-  emptiness_check();
-  huff::BitBuffer bit_buffer;
-  extract_codes_rec(char_buffer_map, root(), bit_buffer);
+size_t HuffTree::tree_info_size() const {
+  return tree_info_size(max_code_length());
+}
+
+void HuffTree::save_tree_info(std::ostream &out) const {
+  uint8_t tree_info[1 + 256];
+  save_tree_info(tree_info);
+  out.write(reinterpret_cast<char *>(tree_info), tree_info_size());
 }
 
-void HuffTree::extract_codes_rec(std::map<char, BitBuffer> &char_buffer_map,
-                                 const TreeNode *node,
-                                 BitBuffer &bit_buffer) const {
-  if (node->type() == huff::TreeNode::EXTERNAL) {
-    char_buffer_map[node->symbol()] = bit_buffer;
-    --bit_buffer.size;
+// Writes the longest code length followed by the lengths of all 256
+// symbols, two per byte when they fit in a nibble and one per byte otherwise.
+void HuffTree::save_tree_info(uint8_t *out) const {
+  emptiness_check();
+  uint8_t max_length = max_code_length();
+  out[0] = max_length;
+  if (max_length > 15) {
+    memcpy(out + 1, code_lengths_.data(), code_lengths_.size());
     return;
   }
+  for (int i = 0; i < 128; ++i) {
+    out[1 + i] = code_lengths_[2 * i] | code_lengths_[2 * i + 1] << 4;
+  }
+}
+
+size_t HuffTree::load_tree_info(const uint8_t *data, size_t size) {
+  if (size == 0 || data[0] == 0 || size < tree_info_size(data[0])) {
+    throw std::runtime_error("File format error!");
+  }
+  uint8_t max_length = data[0];
+  CodeLengths code_lengths = {};
+  if (max_length > 15) {
+    memcpy(code_lengths.data(), data + 1, code_lengths.size());
+  } else {
+    for (int i = 0; i < 128; ++i) {
+      code_lengths[2 * i] = data[1 + i] & 0xF;
+      code_lengths[2 * i + 1] = data[1 + i] >> 4;
+    }
+  }
+  for (auto length : code_lengths) {
+    if (length > max_length) {
+      throw std::runtime_error("File format error!");
+    }
+  }
+  build_canonical_tree(code_lengths);
+  if (tree_.empty() || max_code_length() != max_length) {
+    throw std::runtime_error("File format error!");
+  }
+  return tree_info_size(max_length);
+}
+
+size_t HuffTree::sparse_tree_info_size(uint8_t max_length, size_t leaves) {
+  return 1 + 32 + (max_length > 15 ? leaves : (leaves + 1) / 2);
+}
+
+size_t HuffTree::sparse_tree_info_size() const {
+  size_t leaves = 256 - std::count(code_lengths_.begin(),
+                                   code_lengths_.end(), 0);
+  return sparse_tree_info_size(max_code_length(), leaves);
+}
+
+// Writes the longest code length, a bitmap of the symbols with a code and
+// then the lengths of just those symbols, packed as in save_tree_info.
+// Codes of a few symbols take much less than the full tree info.
+void HuffTree::save_sparse_tree_info(uint8_t *out) const {
+  emptiness_check();
+  uint8_t max_length = max_code_length();
+  out[0] = max_length;
+  memset(out + 1, 0, 32);
+  uint8_t *lengths = out + 1 + 32;
+  size_t leaf = 0;
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    uint8_t length = code_lengths_[symbol];
+    if (length == 0) {
+      continue;
+    }
+    out[1 + symbol / 8] |= 1 << symbol % 8;
+    if (max_length > 15) {
+      lengths[leaf] = length;
+    } else if (leaf % 2 == 0) {
+      lengths[leaf / 2] = length;
+    } else {
+      lengths[leaf / 2] |= length << 4;
+    }
+    ++leaf;
+  }
+}
+
+size_t HuffTree::load_sparse_tree_info(const uint8_t *data, size_t size) {
+  if (size < 1 + 32 || data[0] == 0) {
+    throw std::runtime_error("File format error!");
+  }
+  uint8_t max_length = data[0];
+  size_t leaves = 0;
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    leaves += data[1 + symbol / 8] >> symbol % 8 & 1;
+  }
+  size_t info_size = sparse_tree_info_size(max_length, leaves);
+  if (size < info_size) {
+    throw std::runtime_error("File format error!");
+  }
 
-  if (node->left()) {
-    int byte = bit_buffer.size / 8;
-    int offset = bit_buffer.size % 8;
-    ++bit_buffer.size;
-    extract_codes_rec(char_buffer_map, node->left(), bit_buffer);
-    bit_buffer.buffer[byte] |= 1UL << offset;
-    ++bit_buffer.size;
-    extract_codes_rec(char_buffer_map, node->right(), bit_buffer);
-    bit_buffer.buffer[byte] &= ~(1UL << offset);
+  const uint8_t *lengths = data + 1 + 32;
+  CodeLengths code_lengths = {};
+  size_t leaf = 0;
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    if (!(data[1 + symbol / 8] >> symbol % 8 & 1)) {
+      continue;
+    }
+    uint8_t length = max_length > 15
+                         ? lengths[leaf]
+                         : lengths[leaf / 2] >> 4 * (leaf % 2) & 0xF;
+    if (length == 0 || length > max_length) {
+      throw std::runtime_error("File format error!");
+    }
+    code_lengths[symbol] = length;
+    ++leaf;
+  }
+  build_canonical_tree(code_lengths);
+  if (tree_.empty() || max_code_length() != max_length) {
+    throw std::runtime_error("File format error!");
+  }
+  return info_size;
+}
+
+void HuffTree::extract_codes() {
+  extract_codes(code_table_);
+}
+
+// Assigns canonical codes in order of (length, symbol). Codes are stored
+// bit-reversed, so that the first bit of a code is the first one written.
+void HuffTree::extract_codes(CodeTable &code_table) const {
+  emptiness_check();
+  uint8_t max_length = max_code_length();
+  uint64_t code = 0;
+  for (int length = 1; length <= max_length; ++length) {
+    for (int symbol = 0; symbol < 256; ++symbol) {
+      if (code_lengths_[symbol] != length) {
+        continue;
+      }
+      uint64_t bits = 0;
+      for (int i = 0; i < length; ++i) {
+        bits |= (code >> (length - 1 - i) & 1) << i;
+      }
+      code_table.set(symbol, bits, length);
+      ++code;
+    }
+    code <<= 1;
+  }
+}
+
+void HuffTree::extract_lengths_rec(const TreeNode *node, uint8_t depth) {
+  if (node->type() == TreeNode::EXTERNAL) {
+    code_lengths_[static_cast<uint8_t>(node->symbol())] = depth ? depth : 1;
+    return;
   }
-  --bit_buffer.size;
+  extract_lengths_rec(node->left(), depth + 1);
+  extract_lengths_rec(node->right(), depth + 1);
 }
 
-BitBuffer &HuffTree::operator[](char symbol) {
-  return char_buffer_map_.at(symbol);
+const CodeTable &HuffTree::code_table() const {
+  return code_table_;
 }
 
-const BitBuffer &HuffTree::operator[](char symbol) const {
-  return char_buffer_map_.at(symbol);
+BitBuffer HuffTree::operator[](char symbol) const {
+  uint8_t byte = static_cast<uint8_t>(symbol);
+  BitBuffer bit_buffer(code_table_.size(byte));
+  uint64_t bits = code_table_.bits(byte);
+  for (size_t i = 0; i < sizeof bits; ++i) {
+    bit_buffer.buffer[i] = static_cast<uint8_t>(bits >> 8 * i);
+  }
+  return bit_buffer;
 }
 
 void HuffTree::emptiness_check() const {
@@ -258,131 +752,1928 @@ void HuffTree::emptiness_check() const {
 
 //==================================HuffTree=================================//
 
-//==============================HuffmanArchiver==============================//
+//================================DecodeTable================================//
 
-long HuffmanArchiver::encode(std::istream &in,
-                             std::ostream &out) {
-  encode_buildHuffTree(in);
+const uint8_t DecodeTable::TABLE_BITS;
 
-  try {
-    tree().extract_codes();
-  } catch (const std::logic_error &e) {
-    return 0;
+// The codes are extracted here, since a tree loaded from tree info only
+// has its code lengths.
+DecodeTable::DecodeTable(const HuffTree &huff_tree)
+    : table_(1U << TABLE_BITS, Entry{0, 0}) {
+  CodeTable code_table;
+  huff_tree.extract_codes(code_table);
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    uint8_t size = code_table.size(symbol);
+    if (size == 0 || size > TABLE_BITS) {
+      continue;
+    }
+    for (uint64_t i = code_table.bits(symbol); i < table_.size();
+         i += 1U << size) {
+      table_[i] = Entry{static_cast<char>(symbol), size};
+    }
   }
+}
+
+const DecodeTable::Entry &DecodeTable::operator[](uint64_t bits) const {
+  return table_[bits];
+}
+
+//================================DecodeTable================================//
+
+//=============================MultiDecodeTable==============================//
 
-  tree().save_tree_info(out);
-  long tree_info_size = out.tellp();
+const uint8_t MultiDecodeTable::TABLE_BITS;
+const uint8_t MultiDecodeTable::MAX_SYMBOLS;
 
-  BitWriter bit_writer(out);
-  char symbol;
-  while (in.read(&symbol, sizeof symbol)) {
-    bit_writer.write(tree()[symbol]);
+// Each window is decoded greedily with the single-symbol table. Shifting
+// the window right fills its top with zeros, so an entry is only taken
+// while its code fits in the bits that are really left.
+MultiDecodeTable::MultiDecodeTable(const DecodeTable &table)
+    : table_(1U << TABLE_BITS, Entry{{0, 0, 0, 0}, 0, 0}) {
+  for (uint64_t bits = 0; bits < table_.size(); ++bits) {
+    Entry &entry = table_[bits];
+    while (entry.count < MAX_SYMBOLS) {
+      const DecodeTable::Entry &single = table[bits >> entry.size];
+      if (single.size == 0 || single.size > TABLE_BITS - entry.size) {
+        break;
+      }
+      entry.symbols[entry.count++] = static_cast<uint8_t>(single.symbol);
+      entry.size += single.size;
+    }
   }
-  bit_writer.flush();
+}
 
-  in.clear();
+const MultiDecodeTable::Entry &MultiDecodeTable::operator[](
+    uint64_t bits) const {
+  return table_[bits];
+}
 
-  return tree_info_size;
+// A Huffman code gives a symbol of length l a probability of about 2^-l,
+// which yields the expected code length without the symbol counts. Below
+// half a window at least two symbols come out of a typical lookup; the
+// block also has to be long enough to pay for building the table.
+bool MultiDecodeTable::worthwhile(const CodeLengths &code_lengths,
+                                  size_t symbol_count) {
+  if (symbol_count < 8U << TABLE_BITS) {
+    return false;
+  }
+  uint64_t expected_length = 0;
+  for (uint8_t length : code_lengths) {
+    if (length > 0 && length <= 32) {
+      expected_length += static_cast<uint64_t>(length) << (32 - length);
+    }
+  }
+  return 2 * expected_length <= static_cast<uint64_t>(TABLE_BITS) << 32;
 }
 
-long HuffmanArchiver::decode(std::istream &in,
-                             std::ostream &out) {
-  decode_buildHuffTree(in);
+//=============================MultiDecodeTable==============================//
+
+//==============================ByteDecodeTable==============================//
+
+// The internal nodes are numbered in depth-first order, and every entry
+// is filled in by walking the byte's eight bits down from its node, just
+// as process_byte does while decoding.
+ByteDecodeTable::ByteDecodeTable(const HuffTree &huff_tree) {
+  const TreeNode *root = huff_tree.root();
+  std::vector<const TreeNode *> nodes;
+  std::map<const TreeNode *, uint8_t> states;
+  std::vector<const TreeNode *> stack(1, root);
+  while (!stack.empty()) {
+    const TreeNode *node = stack.back();
+    stack.pop_back();
+    if (node->type() != TreeNode::INTERNAL) {
+      continue;
+    }
+    states[node] = static_cast<uint8_t>(nodes.size());
+    nodes.push_back(node);
+    stack.push_back(node->right());
+    stack.push_back(node->left());
+  }
 
-  try {
-    if (tree().root()->type() == TreeNode::EXTERNAL) {
-      char symbol = tree().root()->symbol();
-      for (size_t i = 0; i < tree().root()->amount(); ++i) {
-        out.write(&symbol, sizeof symbol);
+  table_.resize(nodes.size() << 8);
+  for (size_t state = 0; state < nodes.size(); ++state) {
+    for (int byte = 0; byte < 256; ++byte) {
+      Entry &entry = table_[state << 8 | byte];
+      entry.count = 0;
+      const TreeNode *cur_node = nodes[state];
+      for (int i = 0; i < 8; ++i) {
+        cur_node = byte & (1U << i) ? cur_node->right() : cur_node->left();
+        if (cur_node->type() == TreeNode::EXTERNAL) {
+          entry.symbols[entry.count++] = cur_node->symbol();
+          cur_node = root;
+        }
       }
-      return in.tellg();
+      std::fill(entry.symbols + entry.count, entry.symbols + 8, 0);
+      entry.next = states[cur_node];
     }
-  } catch (const std::logic_error &e) {
-    in.clear();
-    return 0;
   }
+}
 
-  uint8_t last_byte_size;
-  in.read(reinterpret_cast<char *>(&last_byte_size), sizeof last_byte_size);
-  check_format(in);
+const ByteDecodeTable::Entry &ByteDecodeTable::at(uint8_t state,
+                                                  uint8_t byte) const {
+  return table_[static_cast<size_t>(state) << 8 | byte];
+}
 
-  long tree_info_size = in.tellg();
-  in.seekg(0, std::ios_base::end);
-  long file_length = in.tellg() - tree_info_size;
-  in.seekg(tree_info_size);
+size_t ByteDecodeTable::states() const {
+  return table_.size() >> 8;
+}
 
-  const TreeNode *cur_node = tree().root();
-  uint8_t cur_byte = 0;
-  for (int i = 0; i < file_length - 1 + (last_byte_size == 0); ++i) {
-    in.read(reinterpret_cast<char *>(&cur_byte), sizeof cur_byte);
-    cur_node = process_byte(cur_node, cur_byte, 8, out);
-  }
+//==============================ByteDecodeTable==============================//
 
-  if (last_byte_size > 0) {
-    in.read(reinterpret_cast<char *>(&cur_byte), sizeof cur_byte);
-    process_byte(cur_node, cur_byte, last_byte_size, out);
-  }
+//=============================AdaptiveHuffTree==============================//
 
-  return tree_info_size;
+const uint16_t AdaptiveHuffTree::MAX_CODE_SIZE;
+const int16_t AdaptiveHuffTree::NODES;
+const int16_t AdaptiveHuffTree::ROOT;
+
+AdaptiveHuffTree::AdaptiveHuffTree() {
+  reset();
 }
 
-const TreeNode *HuffmanArchiver::process_byte(const TreeNode *cur_node,
-                                              uint8_t byte, int size,
-                                              std::ostream &out) {
-  for (int i = 0; i < size; ++i) {
-    uint8_t cur_bit = byte & (1U << i);
+void AdaptiveHuffTree::reset() {
+  nodes_[ROOT] = Node{0, -1, -1, -1};
+  std::fill(leaves_, leaves_ + 256, -1);
+  escape_ = ROOT;
+}
 
-    if (cur_bit) {
-      cur_node = cur_node->right();
-    } else {
-      cur_node = cur_node->left();
-    }
+uint16_t AdaptiveHuffTree::code_size(uint8_t symbol) const {
+  bool known = leaves_[symbol] >= 0;
+  uint16_t size = known ? 0 : 8;
+  for (int16_t node = known ? leaves_[symbol] : escape_; node != ROOT;
+       node = nodes_[node].parent) {
+    ++size;
+  }
+  return size;
+}
 
-    if (cur_node->type() == TreeNode::EXTERNAL) {
-      char symbol = cur_node->symbol();
-      out.write(&symbol, sizeof symbol);
-      cur_node = tree().root();
+// The path is collected from the leaf up and written from the root down,
+// at most 32 bits at a time. Returns the number of bits written.
+uint16_t AdaptiveHuffTree::encode(uint8_t symbol, BitWriter &bit_writer) {
+  bool known = leaves_[symbol] >= 0;
+  uint8_t path[NODES];
+  uint16_t depth = 0;
+  for (int16_t node = known ? leaves_[symbol] : escape_; node != ROOT;
+       node = nodes_[node].parent) {
+    path[depth++] = node - nodes_[nodes_[node].parent].child;
+  }
+  for (uint16_t left = depth; left > 0;) {
+    uint8_t size = std::min<uint16_t>(left, 32);
+    uint64_t bits = 0;
+    for (uint8_t i = 0; i < size; ++i) {
+      bits |= static_cast<uint64_t>(path[left - 1 - i]) << i;
     }
+    bit_writer.write(bits, size);
+    left -= size;
   }
-  return cur_node;
+  if (!known) {
+    bit_writer.write(symbol, 8);
+  }
+  update(symbol);
+  return depth + (known ? 0 : 8);
 }
 
-void HuffmanArchiver::encode_buildHuffTree(std::istream &in) {
-  std::map<char, uint32_t> amount_table;
-  char symbol;
-  while (in.read(&symbol, sizeof symbol)) {
-    ++amount_table[symbol];
+// Walks down from the root on a whole window of bits at a time.
+uint8_t AdaptiveHuffTree::decode(BitReader &bit_reader) {
+  int16_t node = ROOT;
+  while (nodes_[node].child >= 0) {
+    uint64_t bits = bit_reader.peek(BitReader::MAX_PEEK_BITS);
+    uint8_t used = 0;
+    for (; used < BitReader::MAX_PEEK_BITS && nodes_[node].child >= 0;
+         ++used) {
+      node = nodes_[node].child + (bits >> used & 1);
+    }
+    bit_reader.consume(used);
   }
-  huff_tree_.build_tree(amount_table);
-  in.clear();
-  in.seekg(0);
+  uint8_t symbol;
+  if (node == escape_) {
+    symbol = static_cast<uint8_t>(bit_reader.peek(8));
+    bit_reader.consume(8);
+  } else {
+    symbol = static_cast<uint8_t>(nodes_[node].symbol);
+  }
+  update(symbol);
+  return symbol;
 }
 
-void HuffmanArchiver::decode_buildHuffTree(std::istream &in) {
-  std::map<char, uint32_t> amount_table;
+// Increments the weights from the symbol's leaf up to the root. A new
+// symbol first splits the escape leaf into a new escape leaf and its own.
+// Before every increment the node trades places with the highest-numbered
+// node of the same weight, unless that is its parent, which keeps the
+// positions in order of weight.
+void AdaptiveHuffTree::update(uint8_t symbol) {
+  int16_t node = leaves_[symbol];
+  if (node < 0) {
+    int16_t parent = escape_;
+    nodes_[parent].child = parent - 2;
+    nodes_[parent - 2] = Node{0, parent, -1, -1};
+    nodes_[parent - 1] = Node{0, parent, -1, symbol};
+    escape_ = parent - 2;
+    leaves_[symbol] = node = parent - 1;
+  }
+  for (;;) {
+    int16_t leader = node;
+    while (leader < ROOT &&
+           nodes_[leader + 1].weight == nodes_[node].weight) {
+      ++leader;
+    }
+    if (leader != node && leader != nodes_[node].parent) {
+      swap_nodes(node, leader);
+      node = leader;
+    }
+    ++nodes_[node].weight;
+    if (node == ROOT) {
+      return;
+    }
+    node = nodes_[node].parent;
+  }
+}
 
-  uint8_t size;
-  uint32_t amount;
-  char symbol;
+uint32_t AdaptiveHuffTree::weight(uint8_t symbol) const {
+  return leaves_[symbol] < 0 ? 0 : nodes_[leaves_[symbol]].weight;
+}
 
-  in.read(reinterpret_cast<char *>(&size), sizeof size);
-  if (in.fail()) {
-    huff_tree_.build_tree(amount_table);
-    return;
+// Swaps the subtrees at two positions; the positions keep their parents.
+void AdaptiveHuffTree::swap_nodes(int16_t first, int16_t second) {
+  std::swap(nodes_[first].weight, nodes_[second].weight);
+  std::swap(nodes_[first].child, nodes_[second].child);
+  std::swap(nodes_[first].symbol, nodes_[second].symbol);
+  for (int16_t node : {first, second}) {
+    if (nodes_[node].child >= 0) {
+      nodes_[nodes_[node].child].parent = node;
+      nodes_[nodes_[node].child + 1].parent = node;
+    } else if (nodes_[node].symbol >= 0) {
+      leaves_[nodes_[node].symbol] = node;
+    } else {
+      escape_ = node;
+    }
   }
-  for (int i = 0; i <= size; ++i) {
-    in.read(&symbol, sizeof symbol);
-    in.read(reinterpret_cast<char *>(&amount), sizeof amount);
-    amount_table[symbol] = amount;
+}
+
+//=============================AdaptiveHuffTree==============================//
+
+//==============================HuffmanArchiver==============================//
+
+const uint8_t HuffmanArchiver::VERSION;
+const size_t HuffmanArchiver::FILE_HEADER_SIZE;
+const size_t HuffmanArchiver::BLOCK_HEADER_SIZE;
+const uint32_t HuffmanArchiver::MIN_BLOCK_SIZE;
+const uint32_t HuffmanArchiver::MAX_BLOCK_SIZE;
+const uint32_t HuffmanArchiver::DEFAULT_BLOCK_SIZE;
+const uint8_t HuffmanArchiver::DEFAULT_MAX_CODE_LENGTH;
+const unsigned HuffmanArchiver::MAX_THREADS;
+const uint8_t HuffmanArchiver::MAX_STREAMS;
+const uint8_t HuffmanArchiver::MAX_CONTEXT_TABLES;
+
+namespace {
+
+const char MAGIC[3] = {'H', 'U', 'F'};
+
+void store_u32(uint8_t *out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out[i] = static_cast<uint8_t>(value >> 8 * i);
   }
-  check_format(in);
-  huff_tree_.build_tree(amount_table);
+}
+
+uint32_t load_u32(const uint8_t *data) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= static_cast<uint32_t>(data[i]) << 8 * i;
+  }
+  return value;
+}
+
+using Clock = std::chrono::steady_clock;
+
+// Returns the seconds since mark and moves the mark to now, so that
+// consecutive phases can be timed with one clock read each.
+double lap(Clock::time_point &mark) {
+  Clock::time_point now = Clock::now();
+  double seconds = std::chrono::duration<double>(now - mark).count();
+  mark = now;
+  return seconds;
+}
+
+// A block coded by several streams is cut into equal segments, one per
+// stream, with the last segment taking what is left.
+size_t segment_begin(uint32_t raw_size, uint8_t streams, uint8_t index) {
+  size_t segment = (static_cast<size_t>(raw_size) + streams - 1) / streams;
+  return std::min<size_t>(segment * index, raw_size);
+}
+
+inline uint8_t walk_tree(const TreeNode *root, BitReader &bit_reader) {
+  const TreeNode *cur_node = root;
+  while (cur_node->type() != TreeNode::EXTERNAL) {
+    cur_node = bit_reader.peek(1) ? cur_node->right() : cur_node->left();
+    bit_reader.consume(1);
+  }
+  return cur_node->symbol();
+}
+
+// Table lookup for codes of up to TABLE_BITS bits, tree walk for the rest.
+inline uint8_t decode_symbol(const DecodeTable &table, const TreeNode *root,
+                             BitReader &bit_reader) {
+  const DecodeTable::Entry &entry =
+      table[bit_reader.peek(DecodeTable::TABLE_BITS)];
+  if (entry.size) {
+    bit_reader.consume(entry.size);
+    return entry.symbol;
+  }
+  return walk_tree(root, bit_reader);
+}
+
+// Stores a whole entry of the multi-symbol table with one copy, valid
+// symbols or not, and returns how many of them were decoded. The caller
+// has to leave MAX_SYMBOLS bytes of room at out.
+inline uint8_t decode_symbols(const MultiDecodeTable &table,
+                              const TreeNode *root, BitReader &bit_reader,
+                              uint8_t *out) {
+  const MultiDecodeTable::Entry &entry =
+      table[bit_reader.peek(MultiDecodeTable::TABLE_BITS)];
+  if (entry.count) {
+    memcpy(out, entry.symbols, MultiDecodeTable::MAX_SYMBOLS);
+    bit_reader.consume(entry.size);
+    return entry.count;
+  }
+  *out = walk_tree(root, bit_reader);
+  return 1;
+}
+
+// Decodes count symbols from each of N streams in lock step. The readers
+// and output pointers are copied to locals, which the compiler can keep in
+// registers instead of reloading them after every store to the output.
+template<int N>
+void decode_lockstep(const DecodeTable &table, const TreeNode *root,
+                     BitReader *bit_readers, uint8_t *const *outs,
+                     size_t count) {
+  BitReader readers[N];
+  uint8_t *out[N];
+  for (int j = 0; j < N; ++j) {
+    readers[j] = bit_readers[j];
+    out[j] = outs[j];
+  }
+  for (size_t i = 0; i < count; ++i) {
+    for (int j = 0; j < N; ++j) {
+      out[j][i] = decode_symbol(table, root, readers[j]);
+    }
+  }
+  for (int j = 0; j < N; ++j) {
+    bit_readers[j] = readers[j];
+  }
+}
+
+// Multi-symbol counterpart of decode_lockstep. Every step writes up to
+// MAX_SYMBOLS bytes per stream, so the steps are run in rounds that stop
+// while each stream still has room for a whole entry; the outputs are left
+// where decoding stopped, and the last few symbols go through the
+// single-symbol table.
+template<int N>
+void decode_multi_lockstep(const MultiDecodeTable &table, const TreeNode *root,
+                           BitReader *bit_readers, uint8_t **outs,
+                           const uint8_t *const *ends) {
+  BitReader readers[N];
+  uint8_t *out[N];
+  for (int j = 0; j < N; ++j) {
+    readers[j] = bit_readers[j];
+    out[j] = outs[j];
+  }
+  for (;;) {
+    size_t room = ends[0] - out[0];
+    for (int j = 1; j < N; ++j) {
+      room = std::min<size_t>(room, ends[j] - out[j]);
+    }
+    size_t steps = room / MultiDecodeTable::MAX_SYMBOLS;
+    if (steps == 0) {
+      break;
+    }
+    for (size_t i = 0; i < steps; ++i) {
+      for (int j = 0; j < N; ++j) {
+        out[j] += decode_symbols(table, root, readers[j], out[j]);
+      }
+    }
+  }
+  for (int j = 0; j < N; ++j) {
+    bit_readers[j] = readers[j];
+    outs[j] = out[j];
+  }
+}
+
+// The table of every context takes a nibble while there are at most 16
+// tables and a byte otherwise.
+size_t context_map_size(uint8_t tables) {
+  return tables > 16 ? 256 : 128;
+}
+
+// Groups the contexts of an order-1 histogram, a row of 256 counts per
+// previous byte, into at most max_tables clusters by a few rounds of
+// k-means. The busiest contexts seed the clusters; then every context
+// moves to the cluster whose distribution would code it in the fewest
+// bits, and the clusters are recounted from their contexts. Returns the
+// number of clusters left, each with at least one context; tables maps
+// every context to its cluster, and unused contexts to the first one.
+uint8_t cluster_contexts(const std::vector<uint32_t> &pair_counts,
+                         uint8_t max_tables, uint8_t tables[256]) {
+  uint64_t totals[256] = {};
+  std::vector<int> contexts;
+  std::vector<uint8_t> seen[256];
+  for (int context = 0; context < 256; ++context) {
+    for (int symbol = 0; symbol < 256; ++symbol) {
+      if (pair_counts[context << 8 | symbol]) {
+        totals[context] += pair_counts[context << 8 | symbol];
+        seen[context].push_back(symbol);
+      }
+    }
+    if (totals[context]) {
+      contexts.push_back(context);
+    }
+  }
+  std::stable_sort(contexts.begin(), contexts.end(),
+                   [&](int first, int second) {
+                     return totals[first] > totals[second];
+                   });
+  size_t clusters = std::min<size_t>(max_tables, contexts.size());
+
+  std::vector<int> assignment(256, -1);
+  std::vector<uint64_t> cluster_counts(clusters << 8);
+  for (size_t cluster = 0; cluster < clusters; ++cluster) {
+    for (int symbol = 0; symbol < 256; ++symbol) {
+      cluster_counts[cluster << 8 | symbol] =
+          pair_counts[contexts[cluster] << 8 | symbol];
+    }
+  }
+
+  // Symbols a cluster hasn't seen cost about as much as half an occurrence
+  // would, so that a context isn't kept out of a cluster for good by one
+  // unseen symbol.
+  std::vector<double> costs(clusters << 8);
+  const int MAX_ROUNDS = 8;
+  for (int round = 0; round < MAX_ROUNDS; ++round) {
+    for (size_t cluster = 0; cluster < clusters; ++cluster) {
+      uint64_t total = 0;
+      for (int symbol = 0; symbol < 256; ++symbol) {
+        total += cluster_counts[cluster << 8 | symbol];
+      }
+      double total_bits = std::log2(total + 128.0);
+      for (int symbol = 0; symbol < 256; ++symbol) {
+        costs[cluster << 8 | symbol] =
+            total_bits - std::log2(cluster_counts[cluster << 8 | symbol] + 0.5);
+      }
+    }
+
+    bool moved = false;
+    for (int context : contexts) {
+      const uint32_t *counts = &pair_counts[context << 8];
+      int best = 0;
+      double best_cost = 0;
+      for (size_t cluster = 0; cluster < clusters; ++cluster) {
+        const double *cluster_costs = &costs[cluster << 8];
+        double cost = 0;
+        for (uint8_t symbol : seen[context]) {
+          cost += counts[symbol] * cluster_costs[symbol];
+        }
+        if (cluster == 0 || cost < best_cost) {
+          best = cluster;
+          best_cost = cost;
+        }
+      }
+      moved |= assignment[context] != best;
+      assignment[context] = best;
+    }
+    if (!moved) {
+      break;
+    }
+
+    std::fill(cluster_counts.begin(), cluster_counts.end(), 0);
+    for (int context : contexts) {
+      for (uint8_t symbol : seen[context]) {
+        cluster_counts[assignment[context] << 8 | symbol] +=
+            pair_counts[context << 8 | symbol];
+      }
+    }
+  }
+
+  std::vector<int> renumbered(clusters, -1);
+  uint8_t count = 0;
+  for (int context = 0; context < 256; ++context) {
+    tables[context] = 0;
+    if (assignment[context] < 0) {
+      continue;
+    }
+    if (renumbered[assignment[context]] < 0) {
+      renumbered[assignment[context]] = count++;
+    }
+    tables[context] = renumbered[assignment[context]];
+  }
+  return count;
+}
+
+} //namespace
+
+HuffmanArchiver::HuffmanArchiver()
+    : block_size_(DEFAULT_BLOCK_SIZE),
+      max_code_length_(DEFAULT_MAX_CODE_LENGTH), threads_(1), streams_(1),
+      decode_engine_(AUTO), context_tables_(0), adaptive_(false),
+      stats_() {}
+
+// Runs the job on the pool, or lazily in the caller's get() without one.
+template<class Function>
+std::future<typename std::result_of<Function()>::type>
+HuffmanArchiver::schedule(ThreadPool *pool, Function job) {
+  if (pool) {
+    return pool->submit(job);
+  }
+  return std::async(std::launch::deferred, job);
+}
+
+// In adaptive mode a block only waits for its first byte and then takes
+// whatever else is available, so data is coded as soon as it arrives.
+long HuffmanArchiver::encode(std::istream &in,
+                             std::ostream &out) {
+  auto next_block = [&](size_t &size) -> std::shared_ptr<const uint8_t> {
+    if (!in) {
+      return nullptr;
+    }
+    auto data = std::make_shared<std::vector<uint8_t>>(block_size_);
+    char *block = reinterpret_cast<char *>(data->data());
+    if (adaptive_) {
+      in.read(block, 1);
+      size = in.gcount();
+      while (size > 0 && size < block_size_) {
+        std::streamsize count = in.readsome(block + size, block_size_ - size);
+        if (count <= 0) {
+          break;
+        }
+        size += count;
+      }
+    } else {
+      in.read(block, data->size());
+      size = in.gcount();
+    }
+    if (size == 0) {
+      return nullptr;
+    }
+    return std::shared_ptr<const uint8_t>(data, data->data());
+  };
+  long additional_info_size = encode_blocks(next_block, out);
+  in.clear();
+  return additional_info_size;
+}
+
+// The blocks point straight into the caller's memory, which has to stay
+// valid until encode returns.
+long HuffmanArchiver::encode(const uint8_t *data, size_t size,
+                             std::ostream &out) {
+  size_t pos = 0;
+  auto next_block = [&](size_t &block_size) -> std::shared_ptr<const uint8_t> {
+    if (pos == size) {
+      return nullptr;
+    }
+    block_size = std::min<size_t>(block_size_, size - pos);
+    pos += block_size;
+    return std::shared_ptr<const uint8_t>(std::shared_ptr<const uint8_t>(),
+                                          data + pos - block_size);
+  };
+  return encode_blocks(next_block, out);
+}
+
+long HuffmanArchiver::decode(std::istream &in,
+                             std::ostream &out) {
+  stats_ = Stats();
+  uint8_t file_header[FILE_HEADER_SIZE];
+  in.read(reinterpret_cast<char *>(file_header), sizeof file_header);
+  if (in.gcount() == 0) {
+    in.clear();
+    return 0;
+  }
+  check_format(in);
+  uint32_t block_size = check_file_header(file_header);
+
+  auto next_block = [&](size_t &size) -> std::shared_ptr<const uint8_t> {
+    auto block = std::make_shared<std::vector<uint8_t>>();
+    if (!read_block(in, block_size, *block)) {
+      return nullptr;
+    }
+    size = block->size();
+    return std::shared_ptr<const uint8_t>(block, block->data());
+  };
+  return decode_blocks(next_block, out);
+}
+
+// Blocks are decoded in place, so the archive has to stay valid until
+// decode returns.
+long HuffmanArchiver::decode(const uint8_t *data, size_t size,
+                             std::ostream &out) {
+  stats_ = Stats();
+  if (size == 0) {
+    return 0;
+  }
+  if (size < FILE_HEADER_SIZE) {
+    throw std::runtime_error("File format error!");
+  }
+  uint32_t block_size = check_file_header(data);
+
+  size_t pos = FILE_HEADER_SIZE;
+  auto next_block = [&](size_t &block_bytes) -> std::shared_ptr<const uint8_t> {
+    block_bytes = frame_block(data, size, pos, block_size);
+    if (block_bytes == 0) {
+      return nullptr;
+    }
+    pos += block_bytes;
+    return std::shared_ptr<const uint8_t>(std::shared_ptr<const uint8_t>(),
+                                          data + pos - block_bytes);
+  };
+  return decode_blocks(next_block, out);
+}
+
+// The blocks are coded straight into the caller's buffer. The output is
+// the same as the stream overloads write.
+HuffmanArchiver::Status HuffmanArchiver::encode(const uint8_t *data,
+                                                size_t size, uint8_t *out,
+                                                size_t capacity,
+                                                size_t &out_size) {
+  stats_ = Stats();
+  out_size = 0;
+  if (size == 0) {
+    return OK;
+  }
+  try {
+    Clock::time_point start = Clock::now();
+    Status status =
+        adaptive_ ? encode_adaptive_in_place(data, size, out, capacity, out_size)
+                  : encode_planned(data, size, out, capacity, out_size);
+    stats_.in_bytes = size;
+    stats_.out_bytes = out_size;
+    stats_.total_seconds = lap(start);
+    return status;
+  } catch (const std::exception &) {
+    out_size = 0;
+    return INTERNAL_ERROR;
+  }
+}
+
+// Every block is planned first, on the pool if allowed, which gives the
+// exact size of the archive before anything is written. The blocks are
+// then written in parallel at their offsets. The plans of all blocks are
+// kept until then.
+HuffmanArchiver::Status HuffmanArchiver::encode_planned(const uint8_t *data,
+                                                        size_t size,
+                                                        uint8_t *out,
+                                                        size_t capacity,
+                                                        size_t &out_size) {
+  size_t count = (size + block_size_ - 1) / block_size_;
+  // The pool is declared last, so that it finishes its jobs before what
+  // they write to goes away.
+  std::deque<PreparedBlock> blocks(count);
+  std::deque<Stats> block_stats(count);
+  std::vector<std::future<void>> jobs;
+  std::unique_ptr<ThreadPool> pool;
+  if (threads_ > 1) {
+    pool.reset(new ThreadPool(threads_));
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    const uint8_t *block_data = data + i * block_size_;
+    uint32_t block_size = std::min<size_t>(block_size_, size - i * block_size_);
+    PreparedBlock *prepared = &blocks[i];
+    Stats *stats = &block_stats[i];
+    jobs.push_back(schedule(pool.get(), [=]() {
+      prepare_block(block_data, block_size, *prepared, *stats);
+    }));
+  }
+  size_t total = FILE_HEADER_SIZE + 1;
+  for (size_t i = 0; i < count; ++i) {
+    jobs[i].get();
+    total += BLOCK_HEADER_SIZE + blocks[i].plan.body_size;
+  }
+  if (total > capacity) {
+    return BUFFER_TOO_SMALL;
+  }
+
+  store_file_header(out);
+  uint8_t *block_out = out + FILE_HEADER_SIZE;
+  for (size_t i = 0; i < count; ++i) {
+    const uint8_t *block_data = data + i * block_size_;
+    uint32_t block_size = std::min<size_t>(block_size_, size - i * block_size_);
+    PreparedBlock *prepared = &blocks[i];
+    Stats *stats = &block_stats[i];
+    jobs[i] = schedule(pool.get(), [=]() {
+      write_block(block_data, block_size, *prepared, block_out, *stats);
+    });
+    block_out += BLOCK_HEADER_SIZE + prepared->plan.body_size;
+  }
+  *block_out = END;
+  for (size_t i = 0; i < count; ++i) {
+    jobs[i].get();
+    stats_.add(block_stats[i]);
+  }
+  out_size = total;
+  return OK;
+}
+
+// Adaptive blocks can only be sized by coding them, so they are coded in
+// place one after another. A block that may not fit in what is left of the
+// buffer is coded aside first, and the first one that does not fit stops
+// the encoding.
+HuffmanArchiver::Status HuffmanArchiver::encode_adaptive_in_place(
+    const uint8_t *data, size_t size, uint8_t *out, size_t capacity,
+    size_t &out_size) {
+  if (capacity < FILE_HEADER_SIZE) {
+    return BUFFER_TOO_SMALL;
+  }
+  store_file_header(out);
+  size_t pos = FILE_HEADER_SIZE;
+  AdaptiveHuffTree tree;
+  std::vector<uint8_t> aside;
+  for (size_t in_pos = 0; in_pos < size; in_pos += block_size_) {
+    uint32_t block_size = std::min<size_t>(block_size_, size - in_pos);
+    uint8_t *block = out + pos;
+    if (capacity - pos < adaptive_block_bound(block_size)) {
+      aside.resize(adaptive_block_bound(block_size));
+      block = aside.data();
+    }
+    encode_adaptive(data + in_pos, block_size, tree, block, stats_);
+    size_t block_bytes = BLOCK_HEADER_SIZE + load_u32(block + 5);
+    if (block_bytes > capacity - pos) {
+      return BUFFER_TOO_SMALL;
+    }
+    if (block != out + pos) {
+      memcpy(out + pos, block, block_bytes);
+    }
+    pos += block_bytes;
+  }
+  if (pos == capacity) {
+    return BUFFER_TOO_SMALL;
+  }
+  out[pos++] = END;
+  out_size = pos;
+  return OK;
+}
+
+// The block headers give every block's place in the output, so the blocks
+// are decoded straight into the caller's buffer, in parallel if allowed.
+HuffmanArchiver::Status HuffmanArchiver::decode(const uint8_t *data,
+                                                size_t size, uint8_t *out,
+                                                size_t capacity,
+                                                size_t &out_size) {
+  stats_ = Stats();
+  Status status = decoded_size(data, size, out_size);
+  if (status != OK || size == 0) {
+    return status;
+  }
+  if (out_size > capacity) {
+    out_size = 0;
+    return BUFFER_TOO_SMALL;
+  }
+
+  try {
+    // The pool is declared last, so that if scheduling throws, it runs the
+    // jobs already queued while the stats they write to are still alive.
+    std::vector<std::future<size_t>> blocks;
+    std::deque<Stats> block_stats;
+    AdaptiveHuffTree adaptive_tree;
+    std::unique_ptr<ThreadPool> pool;
+    if (threads_ > 1) {
+      pool.reset(new ThreadPool(threads_));
+    }
+    Clock::time_point start = Clock::now();
+    size_t pos = FILE_HEADER_SIZE;
+    uint8_t *block_out = out;
+    while (data[pos] != END) {
+      const uint8_t *block = data + pos;
+      block_stats.emplace_back();
+      Stats *stats = &block_stats.back();
+      // ADAPTIVE blocks share one model, so they are left to the loop
+      // below, which runs them in order.
+      ThreadPool *block_pool = block[0] == ADAPTIVE ? nullptr : pool.get();
+      AdaptiveHuffTree *tree = &adaptive_tree;
+      blocks.push_back(schedule(block_pool, [=]() {
+        return decode_block(block, block_out, *stats, *tree);
+      }));
+      pos += BLOCK_HEADER_SIZE + load_u32(block + 5);
+      block_out += load_u32(block + 1);
+    }
+
+    // Every block is waited for, so none is still writing to the buffer
+    // when the first error is reported.
+    Status block_status = OK;
+    for (auto &block : blocks) {
+      try {
+        block.get();
+      } catch (const std::runtime_error &) {
+        if (block_status == OK) {
+          block_status = FORMAT_ERROR;
+        }
+      } catch (const std::exception &) {
+        if (block_status == OK) {
+          block_status = INTERNAL_ERROR;
+        }
+      }
+    }
+    if (block_status != OK) {
+      out_size = 0;
+      return block_status;
+    }
+    for (auto &stats : block_stats) {
+      stats_.add(stats);
+    }
+    stats_.in_bytes = pos + 1;
+    stats_.out_bytes = out_size;
+    stats_.total_seconds = lap(start);
+  } catch (const std::exception &) {
+    out_size = 0;
+    return INTERNAL_ERROR;
+  }
+  return OK;
+}
+
+// Every block is stored at worst, so the bound is the input plus the file
+// header, one header per block and the END block.
+size_t HuffmanArchiver::encode_bound(size_t size) const {
+  if (size == 0) {
+    return 0;
+  }
+  size_t blocks = (size + block_size_ - 1) / block_size_;
+  return FILE_HEADER_SIZE + blocks * BLOCK_HEADER_SIZE + size + 1;
+}
+
+// Exact size encode will produce for the data, found by planning every
+// block from its histogram without coding it.
+size_t HuffmanArchiver::encoded_size(const uint8_t *data, size_t size) const {
+  if (size == 0) {
+    return 0;
+  }
+  size_t total = FILE_HEADER_SIZE + 1;
+  AdaptiveHuffTree adaptive_tree;
+  for (size_t pos = 0; pos < size; pos += block_size_) {
+    uint32_t block_size = std::min<size_t>(block_size_, size - pos);
+    if (adaptive_) {
+      total += BLOCK_HEADER_SIZE +
+               adaptive_body_size(data + pos, block_size, adaptive_tree);
+      continue;
+    }
+    uint32_t counts[256] = {};
+    histogram(data + pos, block_size, counts);
+    HuffTree huff_tree;
+    ContextModel model;
+    total += BLOCK_HEADER_SIZE +
+             plan_block(counts, data + pos, block_size, huff_tree, model)
+                 .body_size;
+  }
+  return total;
+}
+
+// Exact size of the framed block coding a histogram of at most block_size
+// symbols. How the symbols split between several streams is not known from
+// the histogram alone, so with more than one stream this is an upper bound,
+// and so it is with context tables, since an order-1 model is only used
+// when it comes out smaller. Adaptive blocks are bounded by the stored size.
+size_t HuffmanArchiver::block_encoded_size(const uint32_t counts[256]) const {
+  uint64_t size = 0;
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    size += counts[symbol];
+  }
+  if (size == 0 || size > block_size_) {
+    throw std::logic_error("Wrong block histogram!");
+  }
+  if (adaptive_) {
+    return BLOCK_HEADER_SIZE + size;
+  }
+  HuffTree huff_tree;
+  ContextModel model;
+  return BLOCK_HEADER_SIZE +
+         plan_block(counts, nullptr, size, huff_tree, model).body_size;
+}
+
+// Walks the block headers of a whole archive and sums up the raw sizes.
+HuffmanArchiver::Status HuffmanArchiver::decoded_size(const uint8_t *data,
+                                                      size_t size,
+                                                      size_t &out_size) {
+  out_size = 0;
+  if (size == 0) {
+    return OK;
+  }
+  try {
+    if (size < FILE_HEADER_SIZE) {
+      throw std::runtime_error("File format error!");
+    }
+    uint32_t block_size = check_file_header(data);
+    size_t pos = FILE_HEADER_SIZE;
+    while (size_t block_bytes = frame_block(data, size, pos, block_size)) {
+      out_size += load_u32(data + pos + 1);
+      pos += block_bytes;
+    }
+  } catch (const std::runtime_error &) {
+    out_size = 0;
+    return FORMAT_ERROR;
+  } catch (const std::exception &) {
+    out_size = 0;
+    return INTERNAL_ERROR;
+  }
+  return OK;
+}
+
+// Blocks are encoded on the pool while the next ones are read; at most two
+// blocks per thread are in flight, and they are written in input order.
+// Without a pool each block is written as soon as it has been read.
+// The input is read once, so it may be a pipe. A failed write stops the
+// encoding, since nothing after it could be written either. Adaptive
+// blocks share one model, so they are coded in order without a pool.
+long HuffmanArchiver::encode_blocks(const BlockSource &next_block,
+                                    std::ostream &out) {
+  stats_ = Stats();
+  AdaptiveHuffTree adaptive_tree;
+  std::unique_ptr<ThreadPool> pool;
+  if (threads_ > 1 && !adaptive_) {
+    pool.reset(new ThreadPool(threads_));
+  }
+  std::deque<std::future<Chunk>> chunks;
+  size_t window = pool ? 2 * threads_ : 1;
+  long additional_info_size = 0;
+  Clock::time_point start = Clock::now();
+
+  auto write_chunk = [&]() {
+    Chunk chunk = chunks.front().get();
+    chunks.pop_front();
+    Clock::time_point mark = Clock::now();
+    out.write(reinterpret_cast<char *>(chunk.bytes.data()), chunk.bytes.size());
+    if (adaptive_) {
+      out.flush();
+    }
+    stats_.write_seconds += lap(mark);
+    stats_.add(chunk.stats);
+    stats_.out_bytes += chunk.bytes.size();
+    additional_info_size += chunk.additional_info_size;
+  };
+
+  size_t size;
+  Clock::time_point mark = Clock::now();
+  while (std::shared_ptr<const uint8_t> data = next_block(size)) {
+    stats_.read_seconds += lap(mark);
+    stats_.in_bytes += size;
+    if (additional_info_size == 0) {
+      uint8_t file_header[FILE_HEADER_SIZE];
+      store_file_header(file_header);
+      out.write(reinterpret_cast<char *>(file_header), sizeof file_header);
+      stats_.out_bytes += sizeof file_header;
+      additional_info_size += sizeof file_header;
+    }
+
+    auto job = [this, data, size, &adaptive_tree]() {
+      Chunk chunk = Chunk();
+      if (adaptive_) {
+        chunk.bytes.resize(adaptive_block_bound(size));
+        chunk.additional_info_size = encode_adaptive(
+            data.get(), size, adaptive_tree, chunk.bytes.data(), chunk.stats);
+        chunk.bytes.resize(BLOCK_HEADER_SIZE + load_u32(&chunk.bytes[5]));
+      } else {
+        chunk.additional_info_size =
+            encode_block(data.get(), size, chunk.bytes, chunk.stats);
+      }
+      return chunk;
+    };
+    chunks.push_back(schedule(pool.get(), job));
+    if (chunks.size() >= window) {
+      write_chunk();
+    }
+    if (!out) {
+      break;
+    }
+    mark = Clock::now();
+  }
+  stats_.read_seconds += lap(mark);
+
+  while (!chunks.empty() && out) {
+    write_chunk();
+  }
+  if (additional_info_size > 0 && out) {
+    char end = END;
+    out.write(&end, sizeof end);
+    ++stats_.out_bytes;
+    ++additional_info_size;
+  }
+  stats_.total_seconds = lap(start);
+  return additional_info_size;
+}
+
+// Mirrors encode_blocks: blocks are decoded on the pool while the next ones
+// are read, and the decoded chunks are written in order from the same
+// window. Every block carries its sizes, so the input is consumed strictly
+// up to the END block and never seeked: it may be a pipe or a socket.
+long HuffmanArchiver::decode_blocks(const BlockSource &next_block,
+                                    std::ostream &out) {
+  AdaptiveHuffTree adaptive_tree;
+  std::unique_ptr<ThreadPool> pool;
+  if (threads_ > 1) {
+    pool.reset(new ThreadPool(threads_));
+  }
+  std::deque<std::future<Chunk>> chunks;
+  size_t window = pool ? 2 * threads_ : 1;
+  long additional_info_size = FILE_HEADER_SIZE + 1;
+  Clock::time_point start = Clock::now();
+
+  auto write_chunk = [&]() {
+    Chunk chunk = chunks.front().get();
+    chunks.pop_front();
+    Clock::time_point mark = Clock::now();
+    out.write(reinterpret_cast<char *>(chunk.bytes.data()), chunk.bytes.size());
+    stats_.write_seconds += lap(mark);
+    stats_.add(chunk.stats);
+    stats_.out_bytes += chunk.bytes.size();
+    additional_info_size += chunk.additional_info_size;
+  };
+
+  stats_.in_bytes = FILE_HEADER_SIZE + 1;
+  size_t size;
+  Clock::time_point mark = Clock::now();
+  while (std::shared_ptr<const uint8_t> block = next_block(size)) {
+    stats_.read_seconds += lap(mark);
+    stats_.in_bytes += size;
+    auto job = [this, block, &adaptive_tree]() {
+      Chunk chunk = Chunk();
+      chunk.bytes.resize(load_u32(block.get() + 1));
+      chunk.additional_info_size = decode_block(
+          block.get(), chunk.bytes.data(), chunk.stats, adaptive_tree);
+      return chunk;
+    };
+    // ADAPTIVE blocks share one model and run in order as they are written.
+    ThreadPool *block_pool = block.get()[0] == ADAPTIVE ? nullptr : pool.get();
+    chunks.push_back(schedule(block_pool, job));
+    if (chunks.size() >= window) {
+      write_chunk();
+    }
+    mark = Clock::now();
+  }
+  stats_.read_seconds += lap(mark);
+
+  while (!chunks.empty()) {
+    write_chunk();
+  }
+  stats_.total_seconds = lap(start);
+  return additional_info_size;
+}
+
+// Chooses how a block with the given histogram is coded and computes the
+// size of its body; huff_tree is left with the block's code lengths. With
+// several streams their sizes are counted over the data, or bounded from
+// the histogram when there is no data. An order-1 model, which needs the
+// data, replaces the single tree when it makes the block smaller, and is
+// then left in model.
+HuffmanArchiver::BlockPlan HuffmanArchiver::plan_block(
+    const uint32_t counts[256], const uint8_t *data, uint32_t size,
+    HuffTree &huff_tree, ContextModel &model) const {
+  BlockPlan plan = {};
+  huff_tree.build_tree(counts);
+  huff_tree.limit_code_lengths(max_code_length_);
+  if (huff_tree.root()->type() == TreeNode::EXTERNAL) {
+    plan.type = RLE;
+    plan.body_size = 1;
+    return plan;
+  }
+
+  plan.type = streams_ > 1 ? HUFFMAN_STREAMS : HUFFMAN;
+  plan.streams = streams_;
+  plan.body_size = huff_tree.tree_info_size();
+  if (streams_ == 1) {
+    plan.stream_sizes[0] = (huff_tree.encoded_bits(counts) + 7) / 8;
+    plan.body_size += plan.stream_sizes[0];
+  } else if (data) {
+    const CodeLengths &code_lengths = huff_tree.code_lengths();
+    plan.body_size += 1 + 4 * (streams_ - 1);
+    for (uint8_t j = 0; j < streams_; ++j) {
+      uint64_t bits = 0;
+      for (size_t i = segment_begin(size, streams_, j);
+           i < segment_begin(size, streams_, j + 1); ++i) {
+        bits += code_lengths[data[i]];
+      }
+      plan.stream_sizes[j] = (bits + 7) / 8;
+      plan.body_size += plan.stream_sizes[j];
+    }
+  } else {
+    plan.body_size += 1 + 4 * (streams_ - 1) +
+                      (huff_tree.encoded_bits(counts) + 7) / 8 + streams_ - 1;
+  }
+
+  if (data && context_tables_ > 0) {
+    size_t model_size = build_context_model(data, size, model);
+    if (model_size < plan.body_size) {
+      plan.type = HUFFMAN_ORDER1;
+      plan.body_size = model_size;
+      plan.streams = 1;
+    }
+  }
+
+  if (plan.body_size >= size) {
+    plan.type = STORED;
+    plan.body_size = size;
+  }
+  return plan;
+}
+
+// Builds the smallest order-1 model of a block it finds, clustering the
+// contexts into at most context_tables_ tables and then into half as many
+// again and again, and returns the size of the block body it would give.
+size_t HuffmanArchiver::build_context_model(const uint8_t *data,
+                                            uint32_t size,
+                                            ContextModel &model) const {
+  std::vector<uint32_t> pair_counts(256 * 256);
+  uint8_t previous = 0;
+  for (uint32_t i = 0; i < size; ++i) {
+    ++pair_counts[previous << 8 | data[i]];
+    previous = data[i];
+  }
+
+  size_t best_size = SIZE_MAX;
+  for (uint8_t max_tables = context_tables_; max_tables > 0; max_tables /= 2) {
+    ContextModel candidate;
+    uint8_t count = cluster_contexts(pair_counts, max_tables,
+                                     candidate.tables);
+    std::vector<uint32_t> counts(count << 8);
+    for (int context = 0; context < 256; ++context) {
+      for (int symbol = 0; symbol < 256; ++symbol) {
+        counts[candidate.tables[context] << 8 | symbol] +=
+            pair_counts[context << 8 | symbol];
+      }
+    }
+
+    candidate.trees.resize(count);
+    uint64_t bits = 0;
+    size_t body_size = 1 + context_map_size(count);
+    for (uint8_t table = 0; table < count; ++table) {
+      HuffTree &tree = candidate.trees[table];
+      tree.build_tree(&counts[table << 8]);
+      tree.limit_code_lengths(max_code_length_);
+      bits += tree.encoded_bits(&counts[table << 8]);
+      body_size += tree.sparse_tree_info_size();
+    }
+    body_size += (bits + 7) / 8;
+    if (body_size < best_size) {
+      best_size = body_size;
+      model = std::move(candidate);
+    }
+  }
+  return best_size;
+}
+
+// Encodes one block into its framed form and returns the number of bytes
+// spent on anything but the data.
+size_t HuffmanArchiver::encode_block(const uint8_t *data, uint32_t size,
+                                     std::vector<uint8_t> &block,
+                                     Stats &stats) const {
+  PreparedBlock prepared;
+  prepare_block(data, size, prepared, stats);
+  block.resize(BLOCK_HEADER_SIZE + prepared.plan.body_size);
+  return write_block(data, size, prepared, block.data(), stats);
+}
+
+void HuffmanArchiver::prepare_block(const uint8_t *data, uint32_t size,
+                                    PreparedBlock &prepared,
+                                    Stats &stats) const {
+  Clock::time_point mark = Clock::now();
+  ++stats.blocks;
+  std::fill(prepared.counts, prepared.counts + 256, 0);
+  histogram(data, size, prepared.counts);
+  stats.histogram_seconds += lap(mark);
+  prepared.plan = plan_block(prepared.counts, data, size, prepared.huff_tree,
+                             prepared.model);
+  stats.build_tree_seconds += lap(mark);
+}
+
+// Writes a prepared block, header included, to the BLOCK_HEADER_SIZE plus
+// body size bytes at block and returns the number of bytes spent on
+// anything but the data. Blocks of a single symbol are run-length coded,
+// and blocks Huffman coding would not shrink are stored as is.
+size_t HuffmanArchiver::write_block(const uint8_t *data, uint32_t size,
+                                    PreparedBlock &prepared, uint8_t *block,
+                                    Stats &stats) const {
+  Clock::time_point mark = Clock::now();
+  const BlockPlan &plan = prepared.plan;
+  const uint32_t *counts = prepared.counts;
+  HuffTree &huff_tree = prepared.huff_tree;
+  block[0] = plan.type;
+  store_u32(block + 1, size);
+  store_u32(block + 5, plan.body_size);
+  uint8_t *body = block + BLOCK_HEADER_SIZE;
+
+  if (plan.type == RLE) {
+    body[0] = data[0];
+    stats.header_seconds += lap(mark);
+    return BLOCK_HEADER_SIZE + 1;
+  }
+  if (plan.type == STORED) {
+    memcpy(body, data, size);
+    stats.pack_seconds += lap(mark);
+    return BLOCK_HEADER_SIZE;
+  }
+
+  stats.symbols += size;
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    if (counts[symbol]) {
+      double probability = static_cast<double>(counts[symbol]) / size;
+      stats.entropy_bits -= counts[symbol] * std::log2(probability);
+    }
+  }
+  if (plan.type == HUFFMAN_ORDER1) {
+    size_t info_size =
+        encode_order1(data, size, prepared.model, body, plan.body_size);
+    stats.code_bits += 8 * (plan.body_size - info_size);
+    for (const HuffTree &tree : prepared.model.trees) {
+      stats.max_code_length = std::max(stats.max_code_length,
+                                       tree.max_code_length());
+    }
+    stats.pack_seconds += lap(mark);
+    return BLOCK_HEADER_SIZE + info_size;
+  }
+  stats.code_bits += huff_tree.encoded_bits(counts);
+  stats.max_code_length = std::max(stats.max_code_length,
+                                   huff_tree.max_code_length());
+
+  huff_tree.extract_codes();
+  stats.extract_codes_seconds += lap(mark);
+  const CodeTable &code_table = huff_tree.code_table();
+  size_t info_size = huff_tree.tree_info_size();
+  huff_tree.save_tree_info(body);
+  if (plan.type == HUFFMAN_STREAMS) {
+    body[info_size] = plan.streams;
+    for (uint8_t j = 0; j + 1 < plan.streams; ++j) {
+      store_u32(body + info_size + 1 + 4 * j, plan.stream_sizes[j]);
+    }
+    info_size += 1 + 4 * (plan.streams - 1);
+  }
+  stats.header_seconds += lap(mark);
+
+  uint8_t *stream = body + info_size;
+  for (uint8_t j = 0; j < plan.streams; ++j) {
+    BitWriter bit_writer(stream, plan.stream_sizes[j]);
+    for (size_t i = segment_begin(size, plan.streams, j);
+         i < segment_begin(size, plan.streams, j + 1); ++i) {
+      uint8_t symbol = data[i];
+      bit_writer.write(code_table.bits(symbol), code_table.size(symbol));
+    }
+    bit_writer.flush();
+    stream += plan.stream_sizes[j];
+  }
+  stats.pack_seconds += lap(mark);
+  return BLOCK_HEADER_SIZE + info_size;
+}
+
+// Writes the body of an order-1 block: the number of tables, the table of
+// every context, the trees and a single bitstream. Returns the size of
+// everything before the bitstream.
+size_t HuffmanArchiver::encode_order1(const uint8_t *data, uint32_t size,
+                                      ContextModel &model, uint8_t *body,
+                                      size_t body_size) const {
+  uint8_t count = static_cast<uint8_t>(model.trees.size());
+  body[0] = count;
+  size_t info_size = 1 + context_map_size(count);
+  for (int context = 0; context < 256; ++context) {
+    if (count > 16) {
+      body[1 + context] = model.tables[context];
+    } else if (context % 2 == 0) {
+      body[1 + context / 2] = model.tables[context];
+    } else {
+      body[1 + context / 2] |= model.tables[context] << 4;
+    }
+  }
+  for (HuffTree &tree : model.trees) {
+    tree.extract_codes();
+    tree.save_sparse_tree_info(body + info_size);
+    info_size += tree.sparse_tree_info_size();
+  }
+
+  const CodeTable *code_tables[256];
+  for (int context = 0; context < 256; ++context) {
+    code_tables[context] = &model.trees[model.tables[context]].code_table();
+  }
+  BitWriter bit_writer(body + info_size, body_size - info_size);
+  uint8_t previous = 0;
+  for (uint32_t i = 0; i < size; ++i) {
+    const CodeTable &code_table = *code_tables[previous];
+    bit_writer.write(code_table.bits(data[i]), code_table.size(data[i]));
+    previous = data[i];
+  }
+  bit_writer.flush();
+  return info_size;
+}
+
+// Size of the body of an adaptive block coded with the model in tree,
+// which is left as encode_adaptive would leave it. The block is stored
+// instead once the adaptive codes would take as much room as the data.
+size_t HuffmanArchiver::adaptive_body_size(const uint8_t *data, uint32_t size,
+                                           AdaptiveHuffTree &tree) {
+  AdaptiveHuffTree saved = tree;
+  uint64_t bits = 0;
+  for (uint32_t i = 0; i < size && bits < 8ULL * size; ++i) {
+    bits += tree.code_size(data[i]);
+    tree.update(data[i]);
+  }
+  if ((bits + 7) / 8 >= size) {
+    tree = saved;
+    return size;
+  }
+  return (bits + 7) / 8;
+}
+
+// Room encode_adaptive needs for a block: its data and one more code past
+// it, which keeps the writer from overflowing before coding stops.
+size_t HuffmanArchiver::adaptive_block_bound(uint32_t size) {
+  return BLOCK_HEADER_SIZE + size + (AdaptiveHuffTree::MAX_CODE_SIZE + 7) / 8;
+}
+
+// Codes the block as it goes with the model in tree, without a histogram,
+// into the adaptive_block_bound bytes at block; its header tells how many
+// of them it took. Coding stops as soon as the output outgrows the data,
+// which is then stored. A stored block is not decoded with the model, so
+// the model is put back to where it was before the block.
+size_t HuffmanArchiver::encode_adaptive(const uint8_t *data, uint32_t size,
+                                        AdaptiveHuffTree &tree, uint8_t *block,
+                                        Stats &stats) const {
+  Clock::time_point mark = Clock::now();
+  ++stats.blocks;
+  AdaptiveHuffTree saved = tree;
+  uint8_t *body = block + BLOCK_HEADER_SIZE;
+  BitWriter bit_writer(body, adaptive_block_bound(size) - BLOCK_HEADER_SIZE);
+  uint64_t bits = 0;
+  for (uint32_t i = 0; i < size && bits < 8ULL * size; ++i) {
+    bits += tree.encode(data[i], bit_writer);
+  }
+
+  size_t body_size = (bits + 7) / 8;
+  if (body_size >= size) {
+    tree = saved;
+    block[0] = STORED;
+    store_u32(block + 1, size);
+    store_u32(block + 5, size);
+    memcpy(body, data, size);
+    stats.pack_seconds += lap(mark);
+    return BLOCK_HEADER_SIZE;
+  }
+
+  bit_writer.flush();
+  block[0] = ADAPTIVE;
+  store_u32(block + 1, size);
+  store_u32(block + 5, body_size);
+  stats.symbols += size;
+  stats.code_bits += bits;
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    if (uint32_t count = tree.weight(symbol) - saved.weight(symbol)) {
+      double probability = static_cast<double>(count) / size;
+      stats.entropy_bits -= count * std::log2(probability);
+    }
+  }
+  stats.pack_seconds += lap(mark);
+  return BLOCK_HEADER_SIZE;
+}
+
+// Reads the next block into memory; returns false on the END block. The
+// sizes are checked before anything is allocated, so a corrupted header
+// cannot make the decoder reserve more than about a block of memory.
+bool HuffmanArchiver::read_block(std::istream &in, uint32_t block_size,
+                                 std::vector<uint8_t> &block) const {
+  block.resize(BLOCK_HEADER_SIZE);
+  in.read(reinterpret_cast<char *>(block.data()), 1);
+  check_format(in);
+  if (block[0] == END) {
+    return false;
+  }
+  in.read(reinterpret_cast<char *>(block.data() + 1), BLOCK_HEADER_SIZE - 1);
+  check_format(in);
+
+  uint32_t body_size = check_block_header(block.data(), block_size);
+  block.resize(BLOCK_HEADER_SIZE + body_size);
+  in.read(reinterpret_cast<char *>(block.data() + BLOCK_HEADER_SIZE),
+          body_size);
+  check_format(in);
+  return true;
+}
+
+// Decodes a block checked by read_block into out, which must have room for
+// its raw size. Returns the number of bytes spent on anything but the data.
+// ADAPTIVE blocks continue the model in adaptive_tree, so they have to be
+// decoded in archive order with the same tree.
+size_t HuffmanArchiver::decode_block(const uint8_t *block, uint8_t *out,
+                                     Stats &stats,
+                                     AdaptiveHuffTree &adaptive_tree) const {
+  Clock::time_point mark = Clock::now();
+  ++stats.blocks;
+  uint32_t raw_size = load_u32(block + 1);
+  uint32_t body_size = load_u32(block + 5);
+  const uint8_t *body = block + BLOCK_HEADER_SIZE;
+
+  if (block[0] == STORED) {
+    memcpy(out, body, raw_size);
+    stats.decode_seconds += lap(mark);
+    return BLOCK_HEADER_SIZE;
+  }
+  if (block[0] == RLE) {
+    memset(out, body[0], raw_size);
+    stats.decode_seconds += lap(mark);
+    return BLOCK_HEADER_SIZE + 1;
+  }
+
+  if (block[0] == ADAPTIVE) {
+    decode_adaptive(adaptive_tree, Stream{body, body_size, out, raw_size});
+    stats.decode_seconds += lap(mark);
+    stats.symbols += raw_size;
+    stats.code_bits += 8 * body_size;
+    return BLOCK_HEADER_SIZE;
+  }
+  if (block[0] == HUFFMAN_ORDER1) {
+    ContextModel model;
+    size_t info_size = load_context_model(body, body_size, model);
+    stats.build_tree_seconds += lap(mark);
+    decode_order1(model, Stream{body + info_size, body_size - info_size, out,
+                                raw_size});
+    stats.decode_seconds += lap(mark);
+    stats.symbols += raw_size;
+    stats.code_bits += 8 * (body_size - info_size);
+    for (const HuffTree &tree : model.trees) {
+      stats.max_code_length = std::max(stats.max_code_length,
+                                       tree.max_code_length());
+    }
+    return BLOCK_HEADER_SIZE + info_size;
+  }
+
+  HuffTree huff_tree;
+  size_t info_size = huff_tree.load_tree_info(body, body_size);
+  if (huff_tree.root()->type() == TreeNode::EXTERNAL) {
+    throw std::runtime_error("File format error!");
+  }
+  stats.build_tree_seconds += lap(mark);
+
+  uint8_t count = 1;
+  size_t stream_sizes[MAX_STREAMS];
+  if (block[0] == HUFFMAN_STREAMS) {
+    count = info_size < body_size ? body[info_size] : 0;
+    if (count < 2 || count > MAX_STREAMS ||
+        body_size - info_size < 1 + 4U * (count - 1)) {
+      throw std::runtime_error("File format error!");
+    }
+    for (uint8_t j = 0; j + 1 < count; ++j) {
+      stream_sizes[j] = load_u32(body + info_size + 1 + 4 * j);
+    }
+    info_size += 1 + 4 * (count - 1);
+  }
+
+  Stream streams[MAX_STREAMS];
+  const uint8_t *stream = body + info_size;
+  size_t left = body_size - info_size;
+  for (uint8_t j = 0; j < count; ++j) {
+    size_t size = j + 1 < count ? stream_sizes[j] : left;
+    if (size > left) {
+      throw std::runtime_error("File format error!");
+    }
+    size_t begin = segment_begin(raw_size, count, j);
+    streams[j] = Stream{stream, size, out + begin,
+                        segment_begin(raw_size, count, j + 1) - begin};
+    stream += size;
+    left -= size;
+  }
+
+  DecodeEngine engine = decode_engine_;
+  if (engine == AUTO) {
+    engine = MultiDecodeTable::worthwhile(huff_tree.code_lengths(), raw_size)
+                 ? MULTI_SYMBOL : TABLE;
+  }
+  if (engine == MULTI_SYMBOL) {
+    decode_multi_symbol(huff_tree, streams, count);
+  } else if (engine == TABLE) {
+    decode_table(huff_tree, streams, count);
+  } else if (engine == BYTE_TABLE) {
+    decode_byte_table(huff_tree, streams, count);
+  } else {
+    for (uint8_t j = 0; j < count; ++j) {
+      decode_tree_walk(huff_tree, streams[j]);
+    }
+  }
+  stats.decode_seconds += lap(mark);
+  stats.symbols += raw_size;
+  stats.code_bits += 8 * (body_size - info_size);
+  stats.max_code_length = std::max(stats.max_code_length,
+                                   huff_tree.max_code_length());
+  return BLOCK_HEADER_SIZE + info_size;
+}
+
+// Reads what encode_order1 writes before the bitstream and returns its
+// size. Unlike the tree of a HUFFMAN block, a tree of an order-1 block may
+// hold a single symbol, which then takes one bit.
+size_t HuffmanArchiver::load_context_model(const uint8_t *body,
+                                           size_t body_size,
+                                           ContextModel &model) {
+  uint8_t count = body_size > 0 ? body[0] : 0;
+  if (count == 0 || count > MAX_CONTEXT_TABLES ||
+      body_size < 1 + context_map_size(count)) {
+    throw std::runtime_error("File format error!");
+  }
+  for (int context = 0; context < 256; ++context) {
+    model.tables[context] = count > 16 ? body[1 + context]
+                                       : body[1 + context / 2] >>
+                                             4 * (context % 2) & 0xF;
+    if (model.tables[context] >= count) {
+      throw std::runtime_error("File format error!");
+    }
+  }
+  size_t info_size = 1 + context_map_size(count);
+  model.trees.resize(count);
+  for (HuffTree &tree : model.trees) {
+    info_size += tree.load_sparse_tree_info(body + info_size,
+                                            body_size - info_size);
+  }
+  return info_size;
+}
+
+void HuffmanArchiver::decode_tree_walk(const HuffTree &huff_tree,
+                                       const Stream &stream) const {
+  const TreeNode *root = huff_tree.root();
+  const TreeNode *cur_node = root;
+  uint8_t *out = stream.out;
+  const uint8_t *out_end = out + stream.symbol_count;
+  for (size_t i = 0; i < stream.size && out != out_end; ++i) {
+    cur_node = process_byte(root, cur_node, stream.data[i], out, out_end);
+  }
+  if (out != out_end) {
+    throw std::runtime_error("File format error!");
+  }
+}
+
+// The streams are decoded side by side, one symbol from each per step, so
+// their independent lookups overlap instead of waiting on one another.
+void HuffmanArchiver::decode_table(const HuffTree &huff_tree,
+                                   const Stream *streams,
+                                   uint8_t count) const {
+  DecodeTable table(huff_tree);
+  const TreeNode *root = huff_tree.root();
+  BitReader bit_readers[MAX_STREAMS];
+  uint8_t *outs[MAX_STREAMS];
+  size_t common_count = streams[0].symbol_count;
+  for (uint8_t j = 0; j < count; ++j) {
+    bit_readers[j] = BitReader(streams[j].data, streams[j].size);
+    outs[j] = streams[j].out;
+    common_count = std::min(common_count, streams[j].symbol_count);
+  }
+
+  uint8_t j = 0;
+  for (; j + 4 <= count; j += 4) {
+    decode_lockstep<4>(table, root, bit_readers + j, outs + j, common_count);
+  }
+  for (; j + 2 <= count; j += 2) {
+    decode_lockstep<2>(table, root, bit_readers + j, outs + j, common_count);
+  }
+  for (; j < count; ++j) {
+    decode_lockstep<1>(table, root, bit_readers + j, outs + j, common_count);
+  }
+  for (j = 0; j < count; ++j) {
+    outs[j] += common_count;
+    decode_lockstep<1>(table, root, bit_readers + j, outs + j,
+                       streams[j].symbol_count - common_count);
+    if (bit_readers[j].overrun()) {
+      throw std::runtime_error("File format error!");
+    }
+  }
+}
+
+void HuffmanArchiver::decode_multi_symbol(const HuffTree &huff_tree,
+                                          const Stream *streams,
+                                          uint8_t count) const {
+  DecodeTable single_table(huff_tree);
+  MultiDecodeTable table(single_table);
+  const TreeNode *root = huff_tree.root();
+  BitReader bit_readers[MAX_STREAMS];
+  uint8_t *outs[MAX_STREAMS];
+  uint8_t *ends[MAX_STREAMS];
+  for (uint8_t j = 0; j < count; ++j) {
+    bit_readers[j] = BitReader(streams[j].data, streams[j].size);
+    outs[j] = streams[j].out;
+    ends[j] = streams[j].out + streams[j].symbol_count;
+  }
+
+  uint8_t j = 0;
+  for (; j + 4 <= count; j += 4) {
+    decode_multi_lockstep<4>(table, root, bit_readers + j, outs + j, ends + j);
+  }
+  for (; j + 2 <= count; j += 2) {
+    decode_multi_lockstep<2>(table, root, bit_readers + j, outs + j, ends + j);
+  }
+  for (; j < count; ++j) {
+    decode_multi_lockstep<1>(table, root, bit_readers + j, outs + j, ends + j);
+  }
+  for (j = 0; j < count; ++j) {
+    decode_lockstep<1>(single_table, root, bit_readers + j, outs + j,
+                       ends[j] - outs[j]);
+    if (bit_readers[j].overrun()) {
+      throw std::runtime_error("File format error!");
+    }
+  }
+}
+
+// The byte just decoded picks the table of the next one, so the symbols
+// depend on one another and come out one at a time whatever the engine.
+void HuffmanArchiver::decode_order1(const ContextModel &model,
+                                    const Stream &stream) const {
+  std::vector<DecodeTable> tables;
+  tables.reserve(model.trees.size());
+  for (const HuffTree &tree : model.trees) {
+    tables.emplace_back(tree);
+  }
+  const DecodeTable *context_tables[256];
+  const TreeNode *roots[256];
+  for (int context = 0; context < 256; ++context) {
+    context_tables[context] = &tables[model.tables[context]];
+    roots[context] = model.trees[model.tables[context]].root();
+  }
+
+  BitReader bit_reader(stream.data, stream.size);
+  uint8_t previous = 0;
+  for (size_t i = 0; i < stream.symbol_count; ++i) {
+    previous = decode_symbol(*context_tables[previous], roots[previous],
+                             bit_reader);
+    stream.out[i] = previous;
+  }
+  if (bit_reader.overrun()) {
+    throw std::runtime_error("File format error!");
+  }
+}
+
+void HuffmanArchiver::decode_adaptive(AdaptiveHuffTree &tree,
+                                      const Stream &stream) const {
+  BitReader bit_reader(stream.data, stream.size);
+  for (size_t i = 0; i < stream.symbol_count; ++i) {
+    stream.out[i] = tree.decode(bit_reader);
+  }
+  if (bit_reader.overrun()) {
+    throw std::runtime_error("File format error!");
+  }
+}
+
+// One table step per compressed byte. The symbols of an entry are copied
+// whole while the output has room for all eight of them; near its end
+// only the ones that fit are, which also drops the ones the padding bits
+// of the last byte would produce.
+void HuffmanArchiver::decode_byte_table(const HuffTree &huff_tree,
+                                        const Stream *streams,
+                                        uint8_t count) const {
+  ByteDecodeTable table(huff_tree);
+  for (uint8_t j = 0; j < count; ++j) {
+    uint8_t *out = streams[j].out;
+    const uint8_t *out_end = out + streams[j].symbol_count;
+    uint8_t state = 0;
+    for (size_t i = 0; i < streams[j].size && out != out_end; ++i) {
+      const ByteDecodeTable::Entry &entry =
+          table.at(state, streams[j].data[i]);
+      size_t room = out_end - out;
+      if (room >= sizeof entry.symbols) {
+        memcpy(out, entry.symbols, sizeof entry.symbols);
+        out += entry.count;
+      } else {
+        size_t symbols = std::min<size_t>(entry.count, room);
+        memcpy(out, entry.symbols, symbols);
+        out += symbols;
+      }
+      state = entry.next;
+    }
+    if (out != out_end) {
+      throw std::runtime_error("File format error!");
+    }
+  }
+}
+
+const TreeNode *HuffmanArchiver::process_byte(const TreeNode *root,
+                                              const TreeNode *cur_node,
+                                              uint8_t byte, uint8_t *&out,
+                                              const uint8_t *out_end) const {
+  for (int i = 0; i < 8 && out != out_end; ++i) {
+    uint8_t cur_bit = byte & (1U << i);
+
+    if (cur_bit) {
+      cur_node = cur_node->right();
+    } else {
+      cur_node = cur_node->left();
+    }
+
+    if (cur_node->type() == TreeNode::EXTERNAL) {
+      *out++ = cur_node->symbol();
+      cur_node = root;
+    }
+  }
+  return cur_node;
+}
+
+// The histogram of each buffer fits in 32-bit counts; the totals over the
+// whole input don't have to.
+void HuffmanArchiver::encode_buildHuffTree(std::istream &in) {
+  uint64_t counts[256] = {};
+  std::vector<uint8_t> in_buffer(1 << 20);
+  while (in) {
+    in.read(reinterpret_cast<char *>(in_buffer.data()), in_buffer.size());
+    uint32_t buffer_counts[256] = {};
+    histogram(in_buffer.data(), in.gcount(), buffer_counts);
+    for (int symbol = 0; symbol < 256; ++symbol) {
+      counts[symbol] += buffer_counts[symbol];
+    }
+  }
+
+  huff_tree_.build_tree(counts);
+  huff_tree_.limit_code_lengths(max_code_length_);
+  in.clear();
+  in.seekg(0);
+}
+
+void HuffmanArchiver::decode_buildHuffTree(std::istream &in) {
+  uint8_t tree_info[1 + 256];
+  in.read(reinterpret_cast<char *>(tree_info), 1);
+  if (in.fail()) {
+    huff_tree_.build_canonical_tree(CodeLengths());
+    return;
+  }
+  size_t size = HuffTree::tree_info_size(tree_info[0]);
+  in.read(reinterpret_cast<char *>(tree_info + 1), size - 1);
+  check_format(in);
+  huff_tree_.load_tree_info(tree_info, size);
 }
 
 HuffTree &HuffmanArchiver::tree() {
   return huff_tree_;
 }
 
+void HuffmanArchiver::block_size(uint32_t size) {
+  if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE) {
+    throw std::runtime_error("Wrong block size!");
+  }
+  block_size_ = size;
+}
+
+uint32_t HuffmanArchiver::block_size() const {
+  return block_size_;
+}
+
+void HuffmanArchiver::max_code_length(uint8_t max_length) {
+  if (max_length < HuffTree::MIN_LENGTH_LIMIT ||
+      max_length > HuffTree::MAX_CODE_LENGTH) {
+    throw std::runtime_error("Wrong maximum code length!");
+  }
+  max_code_length_ = max_length;
+}
+
+uint8_t HuffmanArchiver::max_code_length() const {
+  return max_code_length_;
+}
+
+void HuffmanArchiver::threads(unsigned count) {
+  if (count == 0) {
+    count = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  if (count > MAX_THREADS) {
+    throw std::runtime_error("Wrong number of threads!");
+  }
+  threads_ = count;
+}
+
+unsigned HuffmanArchiver::threads() const {
+  return threads_;
+}
+
+void HuffmanArchiver::streams(uint8_t count) {
+  if (count == 0 || count > MAX_STREAMS) {
+    throw std::runtime_error("Wrong number of streams!");
+  }
+  streams_ = count;
+}
+
+uint8_t HuffmanArchiver::streams() const {
+  return streams_;
+}
+
+void HuffmanArchiver::decode_engine(DecodeEngine engine) {
+  decode_engine_ = engine;
+}
+
+HuffmanArchiver::DecodeEngine HuffmanArchiver::decode_engine() const {
+  return decode_engine_;
+}
+
+void HuffmanArchiver::context_tables(uint8_t count) {
+  if (count > MAX_CONTEXT_TABLES) {
+    throw std::runtime_error("Wrong number of context tables!");
+  }
+  context_tables_ = count;
+}
+
+uint8_t HuffmanArchiver::context_tables() const {
+  return context_tables_;
+}
+
+void HuffmanArchiver::adaptive(bool adaptive_flag) {
+  adaptive_ = adaptive_flag;
+}
+
+bool HuffmanArchiver::adaptive() const {
+  return adaptive_;
+}
+
+uint64_t HuffmanArchiver::in_size() const {
+  return stats_.in_bytes;
+}
+
+uint64_t HuffmanArchiver::out_size() const {
+  return stats_.out_bytes;
+}
+
+const HuffmanArchiver::Stats &HuffmanArchiver::stats() const {
+  return stats_;
+}
+
+void HuffmanArchiver::Stats::add(const Stats &other) {
+  read_seconds += other.read_seconds;
+  histogram_seconds += other.histogram_seconds;
+  build_tree_seconds += other.build_tree_seconds;
+  extract_codes_seconds += other.extract_codes_seconds;
+  header_seconds += other.header_seconds;
+  pack_seconds += other.pack_seconds;
+  decode_seconds += other.decode_seconds;
+  write_seconds += other.write_seconds;
+  total_seconds += other.total_seconds;
+  in_bytes += other.in_bytes;
+  out_bytes += other.out_bytes;
+  blocks += other.blocks;
+  symbols += other.symbols;
+  code_bits += other.code_bits;
+  entropy_bits += other.entropy_bits;
+  max_code_length = std::max(max_code_length, other.max_code_length);
+}
+
+// When decoding the code bits include the padding of every stream.
+double HuffmanArchiver::Stats::average_code_length() const {
+  return symbols ? static_cast<double>(code_bits) / symbols : 0;
+}
+
+double HuffmanArchiver::Stats::entropy() const {
+  return symbols ? entropy_bits / symbols : 0;
+}
+
+void HuffmanArchiver::store_file_header(uint8_t *header) const {
+  memcpy(header, MAGIC, sizeof MAGIC);
+  header[3] = VERSION;
+  store_u32(header + 4, block_size_);
+}
+
+// Validates the file header and returns the block size it declares.
+uint32_t HuffmanArchiver::check_file_header(const uint8_t *header) {
+  uint32_t block_size = load_u32(header + 4);
+  if (memcmp(header, MAGIC, sizeof MAGIC) || header[3] != VERSION ||
+      block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) {
+    throw std::runtime_error("File format error!");
+  }
+  return block_size;
+}
+
+// Validates a block header against the archive's block size and returns
+// the size of the body that follows it.
+uint32_t HuffmanArchiver::check_block_header(const uint8_t *header,
+                                             uint32_t block_size) {
+  uint32_t raw_size = load_u32(header + 1);
+  uint32_t body_size = load_u32(header + 5);
+  uint64_t max_payload_size =
+      (static_cast<uint64_t>(raw_size) * HuffTree::MAX_CODE_LENGTH + 7) / 8;
+  uint64_t max_huffman_size =
+      HuffTree::tree_info_size(HuffTree::MAX_CODE_LENGTH) + max_payload_size;
+  uint64_t max_order1_size =
+      1 + context_map_size(MAX_CONTEXT_TABLES) +
+      MAX_CONTEXT_TABLES *
+          HuffTree::sparse_tree_info_size(HuffTree::MAX_CODE_LENGTH, 256) +
+      max_payload_size;
+  if (raw_size == 0 || raw_size > block_size ||
+      (header[0] == STORED && body_size != raw_size) ||
+      (header[0] == RLE && body_size != 1) ||
+      (header[0] == HUFFMAN && body_size > max_huffman_size) ||
+      (header[0] == HUFFMAN_STREAMS &&
+       body_size > max_huffman_size + 1 + 5 * (MAX_STREAMS - 1)) ||
+      (header[0] == HUFFMAN_ORDER1 && body_size > max_order1_size) ||
+      (header[0] == ADAPTIVE && body_size >= raw_size) ||
+      header[0] > ADAPTIVE) {
+    throw std::runtime_error("File format error!");
+  }
+  return body_size;
+}
+
+// Returns the size of the framed block at pos in an archive held in
+// memory, or 0 if it is the END block.
+size_t HuffmanArchiver::frame_block(const uint8_t *data, size_t size,
+                                    size_t pos, uint32_t block_size) {
+  if (pos == size) {
+    throw std::runtime_error("File format error!");
+  }
+  if (data[pos] == END) {
+    return 0;
+  }
+  if (size - pos < BLOCK_HEADER_SIZE) {
+    throw std::runtime_error("File format error!");
+  }
+  size_t block_bytes =
+      BLOCK_HEADER_SIZE + check_block_header(data + pos, block_size);
+  if (size - pos < block_bytes) {
+    throw std::runtime_error("File format error!");
+  }
+  return block_bytes;
+}
+
 void HuffmanArchiver::check_format(std::istream &in) {
   if (in.fail()) {
     throw std::runtime_error("File format error!");
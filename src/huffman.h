@@ -1,12 +1,19 @@
 #ifndef HW_02_HUFFMAN_H
 #define HW_02_HUFFMAN_H
 
+#include <array>
+#include <functional>
+#include <future>
 #include <map>
 #include <string>
 #include <vector>
 
 namespace huff {
 
+class ThreadPool;
+
+void histogram(const uint8_t *data, size_t size, uint32_t counts[256]);
+
 class TreeNode {
  public:
   enum Type {
@@ -14,8 +21,8 @@ class TreeNode {
   };
 
   TreeNode();
-  TreeNode(char symbol, uint32_t amount);
-  explicit TreeNode(std::pair<const char, uint32_t> sym_am);
+  TreeNode(char symbol, uint64_t amount);
+  explicit TreeNode(std::pair<const char, uint64_t> sym_am);
   TreeNode(TreeNode *left, TreeNode *right);
   TreeNode(const TreeNode &other) = default;
   TreeNode &operator=(const TreeNode &other) = default;
@@ -29,7 +36,7 @@ class TreeNode {
 
   Type type() const;
   char symbol() const;
-  uint32_t amount() const;
+  uint64_t amount() const;
 
   TreeNode *left();
   const TreeNode *left() const;
@@ -41,13 +48,14 @@ class TreeNode {
   bool used_;
   Type type_;
   char symbol_;
-  uint32_t amount_;
+  uint64_t amount_;
   TreeNode *left_;
   TreeNode *right_;
 };
 
 struct BitBuffer {
   explicit BitBuffer(uint16_t size = 0);
+  BitBuffer(const BitBuffer &other) = default;
   BitBuffer &operator=(const BitBuffer &other);
 
   uint16_t size;
@@ -56,21 +64,81 @@ struct BitBuffer {
 
 class BitWriter {
  public:
+  static const size_t OUT_BUFFER_SIZE = 1 << 16;
+
   explicit BitWriter(std::ostream &out);
+  BitWriter(uint8_t *data, size_t size);
 
   void write(const BitBuffer &bit_buffer);
+  void write(uint64_t bits, uint8_t size);
   void flush();
 
  private:
-  uint16_t buffer_;
+  void store();
+  void drain();
+
+  uint64_t buffer_;
   uint8_t size_;
-  std::ostream &out_;
+  std::vector<uint8_t> own_buffer_;
+  uint8_t *out_buffer_;
+  size_t out_capacity_;
+  size_t out_size_;
+  std::ostream *out_;
+};
+
+// Reads bits first bit lowest from memory through a 64-bit reservoir,
+// which a refill tops up to at least MAX_PEEK_BITS bits.
+class BitReader {
+ public:
+  static const uint8_t MAX_PEEK_BITS = 56;
+
+  BitReader();
+  BitReader(const uint8_t *data, size_t size);
+
+  uint64_t peek(uint8_t size);
+  void consume(uint8_t size);
+
+  // Whether more bits were consumed than the data holds; the reader pads
+  // the data with zero bits rather than failing.
+  bool overrun() const;
+
+ private:
+  void refill();
+
+  const uint8_t *cur_;
+  const uint8_t *end_;
+  uint64_t buffer_;
+  uint8_t size_;
+  size_t padding_;
+};
+
+using CodeLengths = std::array<uint8_t, 256>;
+
+// Canonical codes indexed by the byte value. Each entry packs the code bits
+// (first bit lowest) into the low 56 bits of a word and its size into the
+// top 8 bits, so the whole table takes 2 KB.
+class CodeTable {
+ public:
+  static const uint8_t MAX_CODE_SIZE = 56;
+
+  CodeTable();
+
+  void set(uint8_t symbol, uint64_t bits, uint8_t size);
+  uint64_t bits(uint8_t symbol) const;
+  uint8_t size(uint8_t symbol) const;
+
+ private:
+  uint64_t table_[256];
 };
 
 class HuffTree {
  public:
-  HuffTree() = default;
-  explicit HuffTree(std::map<char, uint32_t> &amount_table);
+  static const uint8_t MIN_LENGTH_LIMIT = 8;
+  static const uint8_t MAX_CODE_LENGTH = CodeTable::MAX_CODE_SIZE;
+
+  HuffTree();
+  explicit HuffTree(std::map<char, uint64_t> &amount_table);
+  explicit HuffTree(const CodeLengths &code_lengths);
   HuffTree(const HuffTree &other);
   HuffTree &operator=(const HuffTree &other);
   ~HuffTree() = default;
@@ -78,40 +146,386 @@ class HuffTree {
   const TreeNode *root() const;
   uint8_t leaves_count() const;
 
-  void build_tree(std::map<char, uint32_t> &amount_table);
+  const CodeLengths &code_lengths() const;
+  uint8_t max_code_length() const;
+
+  static uint64_t encoded_bits(const uint32_t counts[256],
+                               const CodeLengths &code_lengths);
+  uint64_t encoded_bits(const uint32_t counts[256]) const;
+
+  void build_tree(std::map<char, uint64_t> &amount_table);
+  void build_tree(const uint32_t counts[256]);
+  void build_tree(const uint64_t counts[256]);
+  void build_canonical_tree(const CodeLengths &code_lengths,
+                            const uint64_t *counts = nullptr);
+  void limit_code_lengths(uint8_t max_length);
+
+  static size_t tree_info_size(uint8_t max_length);
+  size_t tree_info_size() const;
   void save_tree_info(std::ostream &out) const;
+  void save_tree_info(uint8_t *out) const;
+  size_t load_tree_info(const uint8_t *data, size_t size);
+
+  static size_t sparse_tree_info_size(uint8_t max_length, size_t leaves);
+  size_t sparse_tree_info_size() const;
+  void save_sparse_tree_info(uint8_t *out) const;
+  size_t load_sparse_tree_info(const uint8_t *data, size_t size);
 
   void extract_codes();
-  void extract_codes(std::map<char, BitBuffer> &char_buffer_map) const;
+  void extract_codes(CodeTable &code_table) const;
 
-  BitBuffer &operator[](char symbol);
-  const BitBuffer &operator[](char symbol) const;
+  const CodeTable &code_table() const;
+  BitBuffer operator[](char symbol) const;
 
  private:
-  void extract_codes_rec(std::map<char, BitBuffer> &char_buffer_map,
-                         const TreeNode *node, BitBuffer &bit_buffer) const;
+  void merge_leaves();
+  void extract_lengths_rec(const TreeNode *node, uint8_t depth);
   void emptiness_check() const;
 
   std::vector<TreeNode> tree_;
-  std::map<char, BitBuffer> char_buffer_map_;
+  CodeLengths code_lengths_;
+  CodeTable code_table_;
+};
+
+class DecodeTable {
+ public:
+  static const uint8_t TABLE_BITS = 11;
+
+  struct Entry {
+    char symbol;
+    uint8_t size;
+  };
+
+  explicit DecodeTable(const HuffTree &huff_tree);
+
+  const Entry &operator[](uint64_t bits) const;
+
+ private:
+  std::vector<Entry> table_;
+};
+
+// Decoding table whose entries hold every whole code, up to MAX_SYMBOLS of
+// them, that fits in the TABLE_BITS bits looked up, so runs of short codes
+// come out several symbols at a time. Entries whose first code is longer
+// than TABLE_BITS have a zero count.
+class MultiDecodeTable {
+ public:
+  static const uint8_t TABLE_BITS = DecodeTable::TABLE_BITS;
+  static const uint8_t MAX_SYMBOLS = 4;
+
+  struct Entry {
+    uint8_t symbols[MAX_SYMBOLS];
+    uint8_t count;
+    uint8_t size;
+  };
+
+  explicit MultiDecodeTable(const DecodeTable &table);
+
+  const Entry &operator[](uint64_t bits) const;
+
+  static bool worthwhile(const CodeLengths &code_lengths,
+                         size_t symbol_count);
+
+ private:
+  std::vector<Entry> table_;
+};
+
+// Finite-state decoder over whole input bytes. A state is the internal
+// node a partly read code has reached, the root being state 0; for every
+// state and byte value the entry holds the symbols the byte's bits
+// complete, first bit lowest, and the state they leave behind.
+class ByteDecodeTable {
+ public:
+  struct Entry {
+    uint8_t symbols[8];
+    uint8_t count;
+    uint8_t next;
+  };
+
+  explicit ByteDecodeTable(const HuffTree &huff_tree);
+
+  const Entry &at(uint8_t state, uint8_t byte) const;
+  size_t states() const;
+
+ private:
+  std::vector<Entry> table_;
+};
+
+// Adaptive Huffman code by the FGK algorithm: the tree starts out as a
+// single escape leaf and is updated after every symbol, so the encoder and
+// decoder stay in step without a code table or a first pass over the data.
+// A symbol seen for the first time is coded as the escape leaf's code
+// followed by its 8 bits. Nodes live at fixed positions numbered in
+// order of weight, siblings side by side, and the whole tree takes a
+// few kilobytes however much is coded with it.
+class AdaptiveHuffTree {
+ public:
+  static const uint16_t MAX_CODE_SIZE = 256 + 8;
+
+  AdaptiveHuffTree();
+
+  void reset();
+
+  uint16_t code_size(uint8_t symbol) const;
+  uint16_t encode(uint8_t symbol, BitWriter &bit_writer);
+  uint8_t decode(BitReader &bit_reader);
+  void update(uint8_t symbol);
+
+  // Number of times the symbol has been coded since the last reset.
+  uint32_t weight(uint8_t symbol) const;
+
+ private:
+  static const int16_t NODES = 2 * 256 + 1;
+  static const int16_t ROOT = NODES - 1;
+
+  // An internal node has its children at child and child + 1; a leaf has
+  // no child and holds its symbol, or -1 for the escape leaf.
+  struct Node {
+    uint32_t weight;
+    int16_t parent;
+    int16_t child;
+    int16_t symbol;
+  };
+
+  void swap_nodes(int16_t first, int16_t second);
+
+  Node nodes_[NODES];
+  int16_t leaves_[256];
+  int16_t escape_;
 };
 
 class HuffmanArchiver {
  public:
+  // AUTO picks MULTI_SYMBOL or TABLE for each block from its code lengths.
+  // BYTE_TABLE never loads more than a byte at a time.
+  enum DecodeEngine {
+    TREE_WALK, TABLE, MULTI_SYMBOL, AUTO, BYTE_TABLE
+  };
+
+  // Every block but END is framed as type, raw size and body size.
+  // HUFFMAN_STREAMS blocks split their payload into several bitstreams.
+  // HUFFMAN_ORDER1 blocks code every byte with one of several trees, picked
+  // by the byte before it. ADAPTIVE blocks are coded in one pass with an
+  // AdaptiveHuffTree carried over from the archive's previous ADAPTIVE
+  // block, so they carry no code table but are decoded in order.
+  enum BlockType {
+    END, STORED, RLE, HUFFMAN, HUFFMAN_STREAMS, HUFFMAN_ORDER1, ADAPTIVE
+  };
+
+  // Result of the buffer-to-buffer entry points, which don't throw.
+  // INTERNAL_ERROR covers anything but a malformed archive or a short
+  // output buffer, such as running out of memory.
+  enum Status {
+    OK, FORMAT_ERROR, BUFFER_TOO_SMALL, INTERNAL_ERROR
+  };
+
+  // What the last encode or decode call spent its time on and what it
+  // coded. Phase times are summed over the blocks, so on several threads
+  // they may add up to more than the total. The symbol and code length
+  // figures cover the Huffman-coded blocks; the entropy of their data is
+  // only known when encoding.
+  struct Stats {
+    double read_seconds;
+    double histogram_seconds;
+    double build_tree_seconds;
+    double extract_codes_seconds;
+    double header_seconds;
+    double pack_seconds;
+    double decode_seconds;
+    double write_seconds;
+    double total_seconds;
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+    uint64_t blocks;
+    uint64_t symbols;
+    uint64_t code_bits;
+    double entropy_bits;
+    uint8_t max_code_length;
+
+    void add(const Stats &other);
+    double average_code_length() const;
+    double entropy() const;
+  };
+
+  static const uint8_t VERSION = 1;
+  static const size_t FILE_HEADER_SIZE = 8;
+  static const size_t BLOCK_HEADER_SIZE = 9;
+  static const uint32_t MIN_BLOCK_SIZE = 1 << 10;
+  static const uint32_t MAX_BLOCK_SIZE = 1 << 30;
+  static const uint32_t DEFAULT_BLOCK_SIZE = 1 << 20;
+  static const uint8_t DEFAULT_MAX_CODE_LENGTH = 15;
+  static const unsigned MAX_THREADS = 256;
+  static const uint8_t MAX_STREAMS = 8;
+  static const uint8_t MAX_CONTEXT_TABLES = 64;
+
+  HuffmanArchiver();
+
   long encode(std::istream &in, std::ostream &out);
+  long encode(const uint8_t *data, size_t size, std::ostream &out);
   long decode(std::istream &in, std::ostream &out);
+  long decode(const uint8_t *data, size_t size, std::ostream &out);
+
+  // Buffer-to-buffer coding. out_size receives the number of bytes written,
+  // which encode_bound and decoded_size let the caller allocate up front.
+  Status encode(const uint8_t *data, size_t size, uint8_t *out,
+                size_t capacity, size_t &out_size);
+  Status decode(const uint8_t *data, size_t size, uint8_t *out,
+                size_t capacity, size_t &out_size);
+  size_t encode_bound(size_t size) const;
+  size_t encoded_size(const uint8_t *data, size_t size) const;
+  size_t block_encoded_size(const uint32_t counts[256]) const;
+  static Status decoded_size(const uint8_t *data, size_t size,
+                             size_t &out_size);
 
   void encode_buildHuffTree(std::istream &in);
   void decode_buildHuffTree(std::istream &in);
 
   HuffTree &tree();
 
+  void block_size(uint32_t size);
+  uint32_t block_size() const;
+
+  void max_code_length(uint8_t max_length);
+  uint8_t max_code_length() const;
+
+  void threads(unsigned count);
+  unsigned threads() const;
+
+  void streams(uint8_t count);
+  uint8_t streams() const;
+
+  void decode_engine(DecodeEngine engine);
+  DecodeEngine decode_engine() const;
+
+  // Upper limit on the trees of an order-1 block; 0, the default, never
+  // codes blocks with an order-1 model.
+  void context_tables(uint8_t count);
+  uint8_t context_tables() const;
+
+  // Codes every block with one adaptive Huffman model, skipping the
+  // histogram and code tables. Blocks read from a stream are cut from
+  // whatever input is available, and the output is flushed after each.
+  void adaptive(bool adaptive_flag);
+  bool adaptive() const;
+
+  // Bytes consumed and produced by the last encode or decode call, so that
+  // callers streaming through pipes don't have to rely on tellg/tellp.
+  uint64_t in_size() const;
+  uint64_t out_size() const;
+  const Stats &stats() const;
+
  private:
-  const TreeNode *process_byte(const TreeNode *cur_node, uint8_t byte,
-                               int size, std::ostream &out);
+  struct Chunk {
+    std::vector<uint8_t> bytes;
+    size_t additional_info_size;
+    Stats stats;
+  };
+
+  // How a block is coded: its type, body size and, for Huffman blocks, the
+  // sizes of its bitstreams.
+  struct BlockPlan {
+    BlockType type;
+    size_t body_size;
+    uint8_t streams;
+    size_t stream_sizes[MAX_STREAMS];
+  };
+
+  // Order-1 model of a block: the byte before each one, zero at the start
+  // of the block, picks which of the trees codes it.
+  struct ContextModel {
+    uint8_t tables[256];
+    std::vector<HuffTree> trees;
+  };
+
+  // A block whose histogram has been taken and whose coding has been
+  // planned, so that its exact size is known before it is written.
+  struct PreparedBlock {
+    uint32_t counts[256];
+    BlockPlan plan;
+    HuffTree huff_tree;
+    ContextModel model;
+  };
+
+  // One bitstream of a block and the run of output symbols it codes.
+  struct Stream {
+    const uint8_t *data;
+    size_t size;
+    uint8_t *out;
+    size_t symbol_count;
+  };
+
+  // Returns the next block of input and its size, sharing ownership of
+  // whatever keeps it alive, or nullptr at the end of the input.
+  using BlockSource = std::function<std::shared_ptr<const uint8_t>(size_t &)>;
+
+  long encode_blocks(const BlockSource &next_block, std::ostream &out);
+  long decode_blocks(const BlockSource &next_block, std::ostream &out);
+  template<class Function>
+  static std::future<typename std::result_of<Function()>::type>
+  schedule(ThreadPool *pool, Function job);
+
+  BlockPlan plan_block(const uint32_t counts[256], const uint8_t *data,
+                       uint32_t size, HuffTree &huff_tree,
+                       ContextModel &model) const;
+  size_t build_context_model(const uint8_t *data, uint32_t size,
+                             ContextModel &model) const;
+  void store_file_header(uint8_t *header) const;
+  Status encode_planned(const uint8_t *data, size_t size, uint8_t *out,
+                        size_t capacity, size_t &out_size);
+  Status encode_adaptive_in_place(const uint8_t *data, size_t size,
+                                  uint8_t *out, size_t capacity,
+                                  size_t &out_size);
+  size_t encode_block(const uint8_t *data, uint32_t size,
+                      std::vector<uint8_t> &block, Stats &stats) const;
+  void prepare_block(const uint8_t *data, uint32_t size,
+                     PreparedBlock &prepared, Stats &stats) const;
+  size_t write_block(const uint8_t *data, uint32_t size,
+                     PreparedBlock &prepared, uint8_t *block,
+                     Stats &stats) const;
+  size_t encode_order1(const uint8_t *data, uint32_t size,
+                       ContextModel &model, uint8_t *body,
+                       size_t body_size) const;
+  static size_t adaptive_body_size(const uint8_t *data, uint32_t size,
+                                   AdaptiveHuffTree &tree);
+  static size_t adaptive_block_bound(uint32_t size);
+  size_t encode_adaptive(const uint8_t *data, uint32_t size,
+                         AdaptiveHuffTree &tree, uint8_t *block,
+                         Stats &stats) const;
+  bool read_block(std::istream &in, uint32_t block_size,
+                  std::vector<uint8_t> &block) const;
+  size_t decode_block(const uint8_t *block, uint8_t *out, Stats &stats,
+                      AdaptiveHuffTree &adaptive_tree) const;
+
+  static size_t load_context_model(const uint8_t *body, size_t body_size,
+                                   ContextModel &model);
+  void decode_tree_walk(const HuffTree &huff_tree, const Stream &stream) const;
+  void decode_table(const HuffTree &huff_tree, const Stream *streams,
+                    uint8_t count) const;
+  void decode_multi_symbol(const HuffTree &huff_tree, const Stream *streams,
+                           uint8_t count) const;
+  void decode_byte_table(const HuffTree &huff_tree, const Stream *streams,
+                         uint8_t count) const;
+  void decode_order1(const ContextModel &model, const Stream &stream) const;
+  void decode_adaptive(AdaptiveHuffTree &tree, const Stream &stream) const;
+  const TreeNode *process_byte(const TreeNode *root, const TreeNode *cur_node,
+                               uint8_t byte, uint8_t *&out,
+                               const uint8_t *out_end) const;
+  static uint32_t check_file_header(const uint8_t *header);
+  static uint32_t check_block_header(const uint8_t *header,
+                                     uint32_t block_size);
+  static size_t frame_block(const uint8_t *data, size_t size, size_t pos,
+                            uint32_t block_size);
   static void check_format(std::istream &in);
 
   HuffTree huff_tree_;
+  uint32_t block_size_;
+  uint8_t max_code_length_;
+  unsigned threads_;
+  uint8_t streams_;
+  DecodeEngine decode_engine_;
+  uint8_t context_tables_;
+  bool adaptive_;
+  Stats stats_;
 };
 
 } //namespace huff
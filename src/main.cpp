@@ -1,67 +1,218 @@
 #include "huffman.h"
+#include "mapped_file.h"
 
 #include <iostream>
 #include <fstream>
+#include <cstdlib>
 #include <cstring>
 
+namespace {
+
+// Prints the statistics of the last call as a JSON object. The entropy of
+// the data is only known when it has been compressed.
+void print_stats(std::ostream &out, const huff::HuffmanArchiver::Stats &stats,
+                 bool encoded) {
+  out << "{\n"
+      << "  \"seconds\": {\n"
+      << "    \"read\": " << stats.read_seconds << ",\n"
+      << "    \"histogram\": " << stats.histogram_seconds << ",\n"
+      << "    \"build_tree\": " << stats.build_tree_seconds << ",\n"
+      << "    \"extract_codes\": " << stats.extract_codes_seconds << ",\n"
+      << "    \"header\": " << stats.header_seconds << ",\n"
+      << "    \"pack\": " << stats.pack_seconds << ",\n"
+      << "    \"decode\": " << stats.decode_seconds << ",\n"
+      << "    \"write\": " << stats.write_seconds << ",\n"
+      << "    \"total\": " << stats.total_seconds << "\n"
+      << "  },\n"
+      << "  \"in_bytes\": " << stats.in_bytes << ",\n"
+      << "  \"out_bytes\": " << stats.out_bytes << ",\n"
+      << "  \"blocks\": " << stats.blocks << ",\n"
+      << "  \"huffman_symbols\": " << stats.symbols << ",\n"
+      << "  \"average_code_length\": " << stats.average_code_length() << ",\n";
+  if (encoded) {
+    out << "  \"entropy\": " << stats.entropy() << ",\n";
+  }
+  out << "  \"max_code_length\": "
+      << static_cast<int>(stats.max_code_length) << "\n"
+      << "}" << std::endl;
+}
+
+} //namespace
+
 int main(int argc, char** argv) {
+  // Statistics and errors go to stderr when the archive itself goes to stdout.
+  std::ostream *info = &std::cout;
 
   try {
-    if (argc != 6) {
+    if (argc < 2) {
       throw std::runtime_error("Wrong number of arguments!");
     }
     enum archiver_modes {ENCODE, DECODE};
-    std::string in_file, out_file;
+    std::string in_file = "-", out_file = "-";
     int mode = -3;
-    int argi = 1;
+    bool print_json_stats = false;
+    huff::HuffmanArchiver huffman_archiver;
 
-    for (int i = 0; i < 3; ++i) {
+    for (int argi = 1; argi < argc; ++argi) {
       if (!strcmp(argv[argi], "-c")) {
         mode = archiver_modes::ENCODE;
-        ++argi;
         continue;
       }
       if (!strcmp(argv[argi], "-u")) {
         mode = archiver_modes::DECODE;
-        ++argi;
         continue;
       }
-      if (!strcmp(argv[argi], "-f") && argi < 5) {
+      if (!strcmp(argv[argi], "--stats")) {
+        print_json_stats = true;
+        continue;
+      }
+      if (!strcmp(argv[argi], "-a") || !strcmp(argv[argi], "--adaptive")) {
+        huffman_archiver.adaptive(true);
+        continue;
+      }
+      if (argi + 1 == argc) {
+        throw std::runtime_error("Wrong arguments!");
+      }
+      if (!strcmp(argv[argi], "-f") || !strcmp(argv[argi], "--file")) {
         in_file = argv[++argi];
-        ++argi;
         continue;
       }
-      if (!strcmp(argv[argi], "-o") && argi < 5) {
+      if (!strcmp(argv[argi], "-o") || !strcmp(argv[argi], "--output")) {
         out_file = argv[++argi];
+        continue;
+      }
+      if (!strcmp(argv[argi], "-b") || !strcmp(argv[argi], "--block-size")) {
+        char *end;
+        unsigned long block_size = strtoul(argv[++argi], &end, 10);
+        if (*end == 'K' || *end == 'M') {
+          int shift = *end++ == 'K' ? 10 : 20;
+          if (block_size > (UINT32_MAX >> shift)) {
+            throw std::runtime_error("Wrong block size!");
+          }
+          block_size <<= shift;
+        }
+        if (*end || block_size > UINT32_MAX) {
+          throw std::runtime_error("Wrong block size!");
+        }
+        huffman_archiver.block_size(static_cast<uint32_t>(block_size));
+        continue;
+      }
+      if (!strcmp(argv[argi], "-t") || !strcmp(argv[argi], "--threads")) {
+        char *end;
+        unsigned long threads = strtoul(argv[++argi], &end, 10);
+        if (*end || threads > huff::HuffmanArchiver::MAX_THREADS) {
+          throw std::runtime_error("Wrong number of threads!");
+        }
+        huffman_archiver.threads(static_cast<unsigned>(threads));
+        continue;
+      }
+      if (!strcmp(argv[argi], "-s") || !strcmp(argv[argi], "--streams")) {
+        char *end;
+        unsigned long streams = strtoul(argv[++argi], &end, 10);
+        if (*end || streams > huff::HuffmanArchiver::MAX_STREAMS) {
+          throw std::runtime_error("Wrong number of streams!");
+        }
+        huffman_archiver.streams(static_cast<uint8_t>(streams));
+        continue;
+      }
+      if (!strcmp(argv[argi], "-l") || !strcmp(argv[argi], "--max-length")) {
+        char *end;
+        long max_length = strtol(argv[++argi], &end, 10);
+        if (*end || max_length < 0 || max_length > UINT8_MAX) {
+          throw std::runtime_error("Wrong maximum code length!");
+        }
+        huffman_archiver.max_code_length(static_cast<uint8_t>(max_length));
+        continue;
+      }
+      if (!strcmp(argv[argi], "-m") ||
+          !strcmp(argv[argi], "--context-tables")) {
+        char *end;
+        unsigned long tables = strtoul(argv[++argi], &end, 10);
+        if (*end || tables > huff::HuffmanArchiver::MAX_CONTEXT_TABLES) {
+          throw std::runtime_error("Wrong number of context tables!");
+        }
+        huffman_archiver.context_tables(static_cast<uint8_t>(tables));
+        continue;
+      }
+      if (!strcmp(argv[argi], "-e") || !strcmp(argv[argi], "--engine")) {
         ++argi;
+        if (!strcmp(argv[argi], "tree")) {
+          huffman_archiver.decode_engine(huff::HuffmanArchiver::TREE_WALK);
+        } else if (!strcmp(argv[argi], "table")) {
+          huffman_archiver.decode_engine(huff::HuffmanArchiver::TABLE);
+        } else if (!strcmp(argv[argi], "multi")) {
+          huffman_archiver.decode_engine(
+              huff::HuffmanArchiver::MULTI_SYMBOL);
+        } else if (!strcmp(argv[argi], "byte")) {
+          huffman_archiver.decode_engine(huff::HuffmanArchiver::BYTE_TABLE);
+        } else if (!strcmp(argv[argi], "auto")) {
+          huffman_archiver.decode_engine(huff::HuffmanArchiver::AUTO);
+        } else {
+          throw std::runtime_error("Unknown decode engine!");
+        }
+        continue;
       }
+      throw std::runtime_error("Wrong arguments!");
     }
     if (mode == -3 || in_file.empty() || out_file.empty()) {
       throw std::runtime_error("Wrong arguments!");
     }
 
-    std::ifstream fin(in_file, std::ios::binary);
-    if (fin.fail()) {
-      throw std::runtime_error("Can't open the input file!");
+    // "-" stands for stdin/stdout, which lets the archiver sit in a pipe.
+    // Regular files are mapped into memory instead of being read.
+    std::ios::sync_with_stdio(false);
+    huff::MappedFile mapped_in;
+    bool mapped = in_file != "-" && mapped_in.open(in_file);
+    std::ifstream fin;
+    std::istream *in = &std::cin;
+    if (in_file != "-" && !mapped) {
+      fin.open(in_file, std::ios::binary);
+      if (fin.fail()) {
+        throw std::runtime_error("Can't open the input file!");
+      }
+      in = &fin;
     }
 
-    std::ofstream fout(out_file, std::ios::binary);
-    if (fout.fail()) {
-      throw std::runtime_error("Can't open the output file!");
+    std::ofstream fout;
+    std::ostream *out = &std::cout;
+    if (out_file != "-") {
+      fout.open(out_file, std::ios::binary);
+      if (fout.fail()) {
+        throw std::runtime_error("Can't open the output file!");
+      }
+      out = &fout;
+    } else {
+      info = &std::cerr;
     }
 
-    huff::HuffmanArchiver huffman_archiver;
-
     long additional_info_size;
 
-    if (mode == archiver_modes::ENCODE) {
-      additional_info_size = huffman_archiver.encode(fin, fout);
+    if (mapped) {
+      const uint8_t *data = mapped_in.data();
+      size_t size = mapped_in.size();
+      if (mode == archiver_modes::ENCODE) {
+        additional_info_size = huffman_archiver.encode(data, size, *out);
+      } else {
+        additional_info_size = huffman_archiver.decode(data, size, *out);
+      }
+    } else if (mode == archiver_modes::ENCODE) {
+      additional_info_size = huffman_archiver.encode(*in, *out);
     } else {
-      additional_info_size = huffman_archiver.decode(fin, fout);
+      additional_info_size = huffman_archiver.decode(*in, *out);
+    }
+    out->flush();
+    if (out->fail()) {
+      throw std::runtime_error("Can't write the output file!");
+    }
+
+    if (print_json_stats) {
+      print_stats(*info, huffman_archiver.stats(),
+                  mode == archiver_modes::ENCODE);
+      return 0;
     }
 
-    long in_file_size = fin.tellg();
-    long out_file_size = fout.tellp();
+    uint64_t in_file_size = huffman_archiver.in_size();
+    uint64_t out_file_size = huffman_archiver.out_size();
 
     if (mode == archiver_modes::ENCODE) {
       out_file_size -= additional_info_size;
@@ -69,12 +220,12 @@ int main(int argc, char** argv) {
       in_file_size -= additional_info_size;
     }
 
-    std::cout << in_file_size         << std::endl
-              << out_file_size        << std::endl
-              << additional_info_size << std::endl;
+    *info << in_file_size         << std::endl
+          << out_file_size        << std::endl
+          << additional_info_size << std::endl;
 
   } catch (const std::runtime_error &e) {
-    std::cout << e.what() << std::endl;
+    *info << e.what() << std::endl;
   }
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace huff {
+
+MappedFile::MappedFile() : data_(nullptr), size_(0) {}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+// Fails for anything that can't be mapped, such as pipes and devices, so
+// that the caller can fall back to reading a stream. An empty file is
+// opened successfully but has no mapping.
+bool MappedFile::open(const std::string &path) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    ::close(fd);
+    return false;
+  }
+  // A file larger than the address space is left to the stream path.
+  size_t size = info.st_size;
+  if (static_cast<off_t>(size) != info.st_size) {
+    ::close(fd);
+    return false;
+  }
+  if (size > 0) {
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      ::close(fd);
+      return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    data_ = data;
+  }
+  size_ = size;
+  ::close(fd);
+  return true;
+}
+
+void MappedFile::close() {
+  if (data_) {
+    munmap(data_, size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+}
+
+const uint8_t *MappedFile::data() const {
+  return static_cast<const uint8_t *>(data_);
+}
+
+size_t MappedFile::size() const {
+  return size_;
+}
+
+} //namespace huff
@@ -0,0 +1,32 @@
+#ifndef HW_02_MAPPED_FILE_H
+#define HW_02_MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace huff {
+
+// Read-only view of a whole regular file, mapped into memory and advised
+// for sequential access.
+class MappedFile {
+ public:
+  MappedFile();
+  MappedFile(const MappedFile &other) = delete;
+  MappedFile &operator=(const MappedFile &other) = delete;
+  ~MappedFile();
+
+  bool open(const std::string &path);
+  void close();
+
+  const uint8_t *data() const;
+  size_t size() const;
+
+ private:
+  void *data_;
+  size_t size_;
+};
+
+} //namespace huff
+
+#endif //HW_02_MAPPED_FILE_H
@@ -0,0 +1,41 @@
+#include "thread_pool.h"
+
+namespace huff {
+
+ThreadPool::ThreadPool(size_t threads) : stop_(false) {
+  workers_.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+// Workers leave only once the queue is empty, so every submitted task runs
+// and no future is left without a value.
+void ThreadPool::work() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop();
+    }
+    task();
+  }
+}
+
+} //namespace huff
@@ -0,0 +1,53 @@
+#ifndef HW_02_THREAD_POOL_H
+#define HW_02_THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace huff {
+
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t threads);
+  ThreadPool(const ThreadPool &other) = delete;
+  ThreadPool &operator=(const ThreadPool &other) = delete;
+  ~ThreadPool();
+
+  template<class Function>
+  std::future<typename std::result_of<Function()>::type>
+  submit(Function function);
+
+ private:
+  void work();
+
+  std::vector<std::thread> workers_;
+  std::queue<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stop_;
+};
+
+template<class Function>
+std::future<typename std::result_of<Function()>::type>
+ThreadPool::submit(Function function) {
+  using Result = typename std::result_of<Function()>::type;
+  auto task = std::make_shared<std::packaged_task<Result()>>(function);
+  std::future<Result> result = task->get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.emplace([task]() { (*task)(); });
+  }
+  condition_.notify_one();
+  return result;
+}
+
+} //namespace huff
+
+#endif //HW_02_THREAD_POOL_H
@@ -2,6 +2,85 @@
 
 #include "doctest.h"
 #include "huffman.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <queue>
+
+static std::string tree_info(const std::map<char, uint8_t> &code_lengths) {
+  std::string info(1 + 128, 0);
+  for (auto &elem : code_lengths) {
+    uint8_t symbol = static_cast<uint8_t>(elem.first);
+    info[0] = std::max<char>(info[0], elem.second);
+    info[1 + symbol / 2] |= elem.second << (symbol % 2 * 4);
+  }
+  return info;
+}
+
+static std::string u32(uint32_t value) {
+  std::string bytes(sizeof value, 0);
+  memcpy(&bytes[0], &value, sizeof value);
+  return bytes;
+}
+
+static std::string file_header(
+    uint32_t block_size = huff::HuffmanArchiver::DEFAULT_BLOCK_SIZE) {
+  return "HUF" + std::string(1, huff::HuffmanArchiver::VERSION) +
+         u32(block_size);
+}
+
+static std::string block(huff::HuffmanArchiver::BlockType type,
+                         uint32_t raw_size, const std::string &body) {
+  return static_cast<char>(type) + u32(raw_size) + u32(body.size()) + body;
+}
+
+static const std::string end_block(1, huff::HuffmanArchiver::END);
+
+// Hands the data out a few bytes at a time and can't seek, like a pipe.
+class PipeBuf : public std::streambuf {
+ public:
+  explicit PipeBuf(const std::string &data) : data_(data), pos_(0) {}
+
+ protected:
+  int_type underflow() override {
+    if (pos_ == data_.size()) {
+      return traits_type::eof();
+    }
+    size_t size = std::min<size_t>(7, data_.size() - pos_);
+    char *begin = &data_[pos_];
+    setg(begin, begin, begin + size);
+    pos_ += size;
+    return traits_type::to_int_type(*begin);
+  }
+
+ private:
+  std::string data_;
+  size_t pos_;
+};
+
+
+TEST_CASE("testing histogram function") {
+  std::vector<uint8_t> data(1000);
+  uint32_t state = 1;
+  for (auto &byte : data) {
+    state = state * 1103515245 + 12345;
+    byte = static_cast<uint8_t>(state >> 16);
+  }
+  for (size_t offset : {0, 1, 7}) {
+    for (size_t size : {0, 5, 31, 64, 993}) {
+      uint32_t expected[256] = {};
+      for (size_t i = offset; i < offset + size; ++i) {
+        ++expected[data[i]];
+      }
+      uint32_t counts[256] = {};
+      huff::histogram(data.data() + offset, size, counts);
+      CHECK(std::equal(counts, counts + 256, expected));
+    }
+  }
+}
 
 
 TEST_CASE("testing the TreeNode class") {
@@ -92,29 +171,236 @@ TEST_CASE("testing BitBuffer::operator=") {
 }
 
 
+TEST_CASE("testing CodeTable class") {
+  huff::CodeTable code_table;
+  CHECK_EQ(code_table.size('a'), 0);
+  code_table.set('a', 0b101, 3);
+  code_table.set(0xFF, (1ULL << 56) - 1, 56);
+  CHECK_EQ(code_table.bits('a'), 0b101);
+  CHECK_EQ(code_table.size('a'), 3);
+  CHECK_EQ(code_table.bits(0xFF), (1ULL << 56) - 1);
+  CHECK_EQ(code_table.size(0xFF), 56);
+  CHECK_EQ(sizeof code_table, 256 * sizeof(uint64_t));
+}
+
+
 TEST_CASE("testing BitWriter class") {
   std::ostringstream out(std::ios::binary);
-  huff::BitBuffer bit_buffer;
   huff::BitWriter bit_writer(out);
-  bit_buffer.size = 12;
-  bit_buffer.buffer[0] = static_cast<uint8_t>('a');
-  bit_buffer.buffer[1] = static_cast<uint8_t>('\x62');
-  bit_writer.write(bit_buffer);
-  CHECK_EQ(out.str(), "a");
-  bit_buffer.buffer[0] = static_cast<uint8_t>('\x36');
-  bit_buffer.buffer[1] = static_cast<uint8_t>('\xF6');
-  bit_writer.write(bit_buffer);
-  CHECK_EQ(out.str(), "abc");
-  bit_buffer.size = 8;
-  bit_buffer.buffer[0] = static_cast<uint8_t>('d');
-  bit_writer.write(bit_buffer);
-  CHECK_EQ(out.str(), "abcd");
+
+  SUBCASE("writing bit buffers") {
+    huff::BitBuffer bit_buffer;
+    bit_buffer.size = 12;
+    bit_buffer.buffer[0] = static_cast<uint8_t>('a');
+    bit_buffer.buffer[1] = static_cast<uint8_t>('\x62');
+    bit_writer.write(bit_buffer);
+    bit_buffer.buffer[0] = static_cast<uint8_t>('\x36');
+    bit_buffer.buffer[1] = static_cast<uint8_t>('\xF6');
+    bit_writer.write(bit_buffer);
+    bit_buffer.size = 8;
+    bit_buffer.buffer[0] = static_cast<uint8_t>('d');
+    bit_writer.write(bit_buffer);
+    CHECK_EQ(out.str(), "");
+    bit_writer.flush();
+    CHECK_EQ(out.str(), "abcd");
+  }
+
+  SUBCASE("writing codes across the accumulator boundary") {
+    for (int i = 0; i < 3; ++i) {
+      bit_writer.write(0x61, 7);
+      bit_writer.write(0, 1);
+      bit_writer.write(0x7A7978777675ULL, 48);
+    }
+    bit_writer.write(0x7A7978777675ULL, 64);
+    bit_writer.write(0x3, 3);
+    bit_writer.flush();
+    CHECK_EQ(out.str(), std::string("auvwxyzauvwxyzauvwxyz") +
+                        "uvwxyz" + '\0' + '\0' + '\x03');
+  }
+
+  SUBCASE("writing more than the output buffer holds") {
+    for (size_t i = 0; i < huff::BitWriter::OUT_BUFFER_SIZE + 3; ++i) {
+      bit_writer.write('x', 8);
+    }
+    bit_writer.write(0x1, 1);
+    bit_writer.flush();
+    CHECK_EQ(out.str(),
+             std::string(huff::BitWriter::OUT_BUFFER_SIZE + 3, 'x') + '\x01');
+  }
+}
+
+
+TEST_CASE("testing BitReader class") {
+  SUBCASE("reading the last bytes one at a time") {
+    const uint8_t data[] = {'a', 0x62, 0x36, 0xF6};
+    huff::BitReader bit_reader(data, sizeof data);
+    CHECK_EQ(bit_reader.peek(8), 'a');
+    bit_reader.consume(8);
+    CHECK_EQ(bit_reader.peek(4), 0x2);
+    bit_reader.consume(4);
+    CHECK_EQ(bit_reader.peek(12), 0x366);
+    bit_reader.consume(12);
+    CHECK_EQ(bit_reader.peek(16), 0x00F6);
+    bit_reader.consume(8);
+    CHECK_FALSE(bit_reader.overrun());
+    bit_reader.consume(1);
+    CHECK(bit_reader.overrun());
+  }
+
+  SUBCASE("reading codes written by BitWriter") {
+    std::vector<uint8_t> data(1000);
+    huff::BitWriter bit_writer(data.data(), data.size());
+    size_t bits = 0;
+    for (uint8_t size = 1; bits + size <= 8 * data.size();
+         size = size % huff::BitReader::MAX_PEEK_BITS + 1) {
+      bit_writer.write(0x5A5A5A5A5A5A5A5AULL >> (64 - size), size);
+      bits += size;
+    }
+    bit_writer.flush();
+
+    huff::BitReader bit_reader(data.data(), (bits + 7) / 8);
+    bool same = true;
+    for (uint8_t size = 1; bits >= size;
+         size = size % huff::BitReader::MAX_PEEK_BITS + 1) {
+      same = same &&
+             bit_reader.peek(size) == 0x5A5A5A5A5A5A5A5AULL >> (64 - size);
+      bit_reader.consume(size);
+      bits -= size;
+    }
+    CHECK(same);
+    CHECK_FALSE(bit_reader.overrun());
+  }
+
+  SUBCASE("peeking the widest window off a byte boundary") {
+    const uint8_t data[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+    huff::BitReader bit_reader(data, sizeof data);
+    CHECK_EQ(bit_reader.peek(5), 0x01);
+    bit_reader.consume(5);
+    CHECK_EQ(bit_reader.peek(huff::BitReader::MAX_PEEK_BITS),
+             0x40383028201810ULL);
+    bit_reader.consume(huff::BitReader::MAX_PEEK_BITS);
+    CHECK_EQ(bit_reader.peek(27), 0x585048U);
+    CHECK_FALSE(bit_reader.overrun());
+  }
+}
+
+
+TEST_CASE("testing DecodeTable class") {
+  std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+  huff::HuffTree huff_tree(amount_table);
+  huff::DecodeTable table(huff_tree);
+  CHECK_EQ(table[0b101].symbol, 'a');
+  CHECK_EQ(table[0b101].size, 2);
+  CHECK_EQ(table[0b111].symbol, 'b');
+  CHECK_EQ(table[0b111].size, 2);
+  CHECK_EQ(table[0b110].symbol, 'c');
+  CHECK_EQ(table[0b110].size, 1);
+
+  huff::HuffTree loaded_tree(huff_tree.code_lengths());
+  huff::DecodeTable loaded_table(loaded_tree);
+  CHECK_EQ(loaded_table[0b101].symbol, 'a');
+  CHECK_EQ(loaded_table[0b101].size, 2);
+
+  std::string info = tree_info({ {'x', 1}, {'y', 2}, {'z', 2} });
+  huff::HuffTree info_tree(huff_tree);
+  info_tree.load_tree_info(reinterpret_cast<const uint8_t *>(info.data()),
+                           info.size());
+  CHECK_EQ(info_tree.code_table().size('x'), 1);
+  CHECK_EQ(info_tree.code_table().size('a'), 0);
+  huff::DecodeTable info_table(info_tree);
+  int wrong_entries = 0;
+  for (uint64_t bits = 0; bits < 1U << huff::DecodeTable::TABLE_BITS;
+       ++bits) {
+    wrong_entries += info_table[bits].size == 0 ||
+                     info_table[bits].symbol == 'a';
+  }
+  CHECK_EQ(wrong_entries, 0);
+}
+
+TEST_CASE("testing MultiDecodeTable class") {
+  std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+  huff::HuffTree huff_tree(amount_table);
+  huff::DecodeTable single_table(huff_tree);
+  huff::MultiDecodeTable table(single_table);
+  CHECK_EQ(table[0].count, 4);
+  CHECK_EQ(table[0].size, 4);
+  CHECK_EQ(std::string(table[0].symbols, table[0].symbols + 4), "cccc");
+  CHECK_EQ(table[0b111].count, 4);
+  CHECK_EQ(table[0b111].size, 6);
+  CHECK_EQ(std::string(table[0b111].symbols, table[0b111].symbols + 4),
+           "bacc");
+
+  huff::CodeLengths code_lengths = {};
+  for (int symbol = 0; symbol < 4; ++symbol) {
+    code_lengths[symbol] = 2;
+  }
+  CHECK(huff::MultiDecodeTable::worthwhile(code_lengths, 1 << 20));
+  CHECK_FALSE(huff::MultiDecodeTable::worthwhile(code_lengths, 100));
+  for (int symbol = 0; symbol < 256; ++symbol) {
+    code_lengths[symbol] = 8;
+  }
+  CHECK_FALSE(huff::MultiDecodeTable::worthwhile(code_lengths, 1 << 20));
+}
+
+
+TEST_CASE("testing ByteDecodeTable class") {
+  std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+  huff::HuffTree huff_tree(amount_table);
+  huff::HuffTree canonical_tree(huff_tree.code_lengths());
+  huff::ByteDecodeTable table(canonical_tree);
+  CHECK_EQ(table.states(), 2);
+  CHECK_EQ(table.at(0, 0).count, 8);
+  CHECK_EQ(table.at(0, 0).next, 0);
+  CHECK_EQ(std::string(table.at(0, 0b1).symbols,
+                       table.at(0, 0b1).symbols + table.at(0, 0b1).count),
+           "acccccc");
+  CHECK_EQ(table.at(0, 0xFF).count, 4);
+  CHECK_EQ(table.at(0, 0xFF).symbols[0], 'b');
+  CHECK_EQ(table.at(0, 0b10000000).count, 7);
+  CHECK_EQ(table.at(0, 0b10000000).next, 1);
+  CHECK_EQ(table.at(1, 0b10000000).symbols[0], 'a');
+  CHECK_EQ(table.at(1, 0b10000000).next, 1);
 }
 
+TEST_CASE("testing AdaptiveHuffTree class") {
+  huff::AdaptiveHuffTree encoder;
+  CHECK_EQ(encoder.code_size('a'), 8);
+  std::vector<uint8_t> data(64);
+  huff::BitWriter bit_writer(data.data(), data.size());
+  CHECK_EQ(encoder.encode('a', bit_writer), 8);
+  CHECK_EQ(encoder.code_size('a'), 1);
+  CHECK_EQ(encoder.code_size('b'), 1 + 8);
+
+  std::string test_str = "abracadabra, abracadabra";
+  uint64_t bits = 8;
+  for (size_t i = 1; i < test_str.size(); ++i) {
+    uint8_t symbol = static_cast<uint8_t>(test_str[i]);
+    uint16_t size = encoder.code_size(symbol);
+    CHECK_EQ(encoder.encode(symbol, bit_writer), size);
+    bits += size;
+  }
+  bit_writer.flush();
+  CHECK_EQ(encoder.weight('a'), 10);
+  CHECK_EQ(encoder.weight('z'), 0);
+  CHECK_LT(bits, 8 * test_str.size());
+
+  huff::AdaptiveHuffTree decoder;
+  huff::BitReader bit_reader(data.data(), (bits + 7) / 8);
+  std::string decoded;
+  for (size_t i = 0; i < test_str.size(); ++i) {
+    decoded += static_cast<char>(decoder.decode(bit_reader));
+  }
+  CHECK_EQ(decoded, test_str);
+  CHECK_FALSE(bit_reader.overrun());
+
+  encoder.reset();
+  CHECK_EQ(encoder.weight('a'), 0);
+  CHECK_EQ(encoder.code_size('a'), 8);
+}
 
 TEST_CASE("testing the HuffTree class") {
   SUBCASE("testing constructing a tree from an amount table") {
-    std::map<char, uint32_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+    std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
     huff::HuffTree huff_tree(amount_table);
     REQUIRE_NOTHROW(huff_tree.root());
     REQUIRE_FALSE(huff_tree.root()->left() == nullptr);
@@ -134,20 +420,40 @@ TEST_CASE("testing the HuffTree class") {
   }
 
   SUBCASE("testing constructing a tree from an empty amount table") {
-    std::map<char, uint32_t> amount_table = {};
+    std::map<char, uint64_t> amount_table = {};
     huff::HuffTree huff_tree(amount_table);
     CHECK_THROWS_WITH_AS(huff_tree.root(),
                          "The tree is empty!", std::logic_error);
   }
 
   SUBCASE("testing constructing a tree from an amount table with one entry") {
-    std::map<char, uint32_t> amount_table = { {'a', 100} };
+    std::map<char, uint64_t> amount_table = { {'a', 100} };
     huff::HuffTree huff_tree(amount_table);
     CHECK_EQ(*huff_tree.root(), huff::TreeNode('a', 100));
   }
 
+  SUBCASE("testing amounts beyond 32 bits") {
+    std::map<char, uint64_t> amount_table = {
+        {'a', 1}, {'b', 1ULL << 33}, {'c', 3ULL << 32} };
+    huff::HuffTree huff_tree(amount_table);
+    CHECK_EQ(huff_tree.root()->amount(), (5ULL << 32) + 1);
+    CHECK_EQ(huff_tree.code_lengths()['a'], 2);
+    CHECK_EQ(huff_tree.code_lengths()['b'], 2);
+    CHECK_EQ(huff_tree.code_lengths()['c'], 1);
+
+    uint64_t counts[256] = {};
+    for (int symbol = 0; symbol < 20; ++symbol) {
+      counts[symbol] = 1ULL << (symbol + 20);
+    }
+    huff_tree.build_tree(counts);
+    CHECK_EQ(huff_tree.max_code_length(), 19);
+    huff_tree.limit_code_lengths(huff::HuffTree::MIN_LENGTH_LIMIT);
+    CHECK_EQ(huff_tree.max_code_length(), huff::HuffTree::MIN_LENGTH_LIMIT);
+    CHECK_EQ(huff_tree.root()->amount(), ((1ULL << 20) - 1) << 20);
+  }
+
   SUBCASE("testing HuffTree::operator=") {
-    std::map<char, uint32_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+    std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
     huff::HuffTree huff_tree_copy;
     {
       huff::HuffTree huff_tree(amount_table);
@@ -171,7 +477,7 @@ TEST_CASE("testing the HuffTree class") {
   }
 
   SUBCASE("testing HuffTree::leaves_count") {
-    std::map<char, uint32_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+    std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
     huff::HuffTree huff_tree(amount_table);
     CHECK_EQ(huff_tree.leaves_count(), 2);
     amount_table = { {'a', 2} };
@@ -184,28 +490,202 @@ TEST_CASE("testing the HuffTree class") {
   }
 
   SUBCASE("testing HuffTree::save_tree_info method") {
-    std::map<char, uint32_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+    std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
     huff::HuffTree huff_tree(amount_table);
     REQUIRE_NOTHROW(huff_tree.extract_codes());
     std::ostringstream out(std::ios::binary);
     REQUIRE_NOTHROW(huff_tree.save_tree_info(out));
-    std::string test_str{2, 'a', 1, 0, 0, 0,
-                            'b', 2, 0, 0, 0,
-                            'c', 4, 0, 0, 0, 2};
+    std::string test_str(1 + 128, 0);
+    test_str[0] = 2;
+    test_str[1 + 'a' / 2] = 0x20;
+    test_str[1 + 'b' / 2] = 0x12;
     CHECK_EQ(out.str(), test_str);
   }
 
+  SUBCASE("testing HuffTree::save_sparse_tree_info method") {
+    std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+    huff::HuffTree huff_tree(amount_table);
+    CHECK_EQ(huff_tree.sparse_tree_info_size(), 1 + 32 + 2);
+    uint8_t info[1 + 32 + 2];
+    huff_tree.save_sparse_tree_info(info);
+    CHECK_EQ(info[0], 2);
+    CHECK_EQ(info[1 + 'a' / 8], 0x0E);
+    CHECK_EQ(info[1 + 32], 0x22);
+    CHECK_EQ(info[1 + 32 + 1], 0x01);
+
+    huff::HuffTree loaded;
+    CHECK_EQ(loaded.load_sparse_tree_info(info, sizeof info), sizeof info);
+    CHECK(loaded.code_lengths() == huff_tree.code_lengths());
+    CHECK_THROWS_WITH_AS(loaded.load_sparse_tree_info(info, sizeof info - 1),
+                         "File format error!", std::runtime_error);
+    info[1 + 32] = 0x02;
+    CHECK_THROWS_WITH_AS(loaded.load_sparse_tree_info(info, sizeof info),
+                         "File format error!", std::runtime_error);
+  }
+
+  SUBCASE("testing HuffTree::code_lengths method") {
+    std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+    huff::HuffTree huff_tree(amount_table);
+    CHECK_EQ(huff_tree.code_lengths()['a'], 2);
+    CHECK_EQ(huff_tree.code_lengths()['b'], 2);
+    CHECK_EQ(huff_tree.code_lengths()['c'], 1);
+    CHECK_EQ(huff_tree.code_lengths()['d'], 0);
+    CHECK_EQ(huff_tree.max_code_length(), 2);
+    amount_table = { {'a', 100} };
+    huff_tree.build_tree(amount_table);
+    CHECK_EQ(huff_tree.code_lengths()['a'], 1);
+  }
+
+  SUBCASE("testing HuffTree::encoded_bits method") {
+    uint32_t counts[256] = {};
+    counts['a'] = 1;
+    counts['b'] = 2;
+    counts['c'] = 4;
+    huff::HuffTree huff_tree;
+    huff_tree.build_tree(counts);
+    CHECK_EQ(huff_tree.encoded_bits(counts), 1 * 2 + 2 * 2 + 4 * 1);
+    huff::CodeLengths code_lengths = {};
+    code_lengths['a'] = code_lengths['b'] = code_lengths['c'] = 8;
+    CHECK_EQ(huff::HuffTree::encoded_bits(counts, code_lengths), 7 * 8);
+  }
+
+  SUBCASE("testing HuffTree::build_tree optimality") {
+    uint32_t counts[256] = {};
+    uint32_t state = 7;
+    for (auto &count : counts) {
+      state = state * 1103515245 + 12345;
+      count = (state >> 16) % 1000;
+    }
+    huff::HuffTree huff_tree;
+    huff_tree.build_tree(counts);
+
+    std::priority_queue<uint64_t, std::vector<uint64_t>,
+                        std::greater<uint64_t>> queue;
+    uint64_t expected_bits = 0;
+    uint64_t bits = 0;
+    std::map<char, uint64_t> amount_table;
+    for (int symbol = 0; symbol < 256; ++symbol) {
+      if (counts[symbol]) {
+        queue.push(counts[symbol]);
+        bits += counts[symbol] * huff_tree.code_lengths()[symbol];
+        amount_table[static_cast<char>(symbol)] = counts[symbol];
+      }
+    }
+    while (queue.size() > 1) {
+      uint64_t first = queue.top();
+      queue.pop();
+      uint64_t second = queue.top();
+      queue.pop();
+      expected_bits += first + second;
+      queue.push(first + second);
+    }
+    CHECK_EQ(bits, expected_bits);
+    CHECK_EQ(huff::HuffTree(amount_table).code_lengths(),
+             huff_tree.code_lengths());
+  }
+
+  SUBCASE("testing HuffTree::limit_code_lengths method") {
+    uint32_t counts[256] = {};
+    uint32_t amount[2] = {1, 1};
+    for (int symbol = 0; symbol < 30; ++symbol) {
+      counts[symbol] = amount[0];
+      amount[0] += amount[1];
+      std::swap(amount[0], amount[1]);
+    }
+    huff::HuffTree huff_tree;
+    huff_tree.build_tree(counts);
+    REQUIRE_EQ(huff_tree.max_code_length(), 29);
+    huff::CodeLengths unlimited = huff_tree.code_lengths();
+    huff_tree.limit_code_lengths(29);
+    CHECK_EQ(huff_tree.code_lengths(), unlimited);
+
+    for (uint8_t max_length : {8, 12, 15}) {
+      huff_tree.build_tree(counts);
+      huff_tree.limit_code_lengths(max_length);
+      CHECK_EQ(huff_tree.max_code_length(), max_length);
+      CHECK_EQ(huff_tree.root()->amount(), amount[1] - 1);
+      uint64_t kraft_sum = 0;
+      for (auto length : huff_tree.code_lengths()) {
+        if (length) {
+          kraft_sum += 1ULL << (max_length - length);
+        }
+      }
+      CHECK_EQ(kraft_sum, 1ULL << max_length);
+    }
+
+    CHECK_LE(huff_tree.code_lengths()[29], huff_tree.code_lengths()[28]);
+    CHECK_EQ(huff_tree.code_lengths()[0], 15);
+    CHECK_THROWS_AS(huff_tree.limit_code_lengths(4), std::logic_error);
+  }
+
+  SUBCASE("testing HuffTree::build_canonical_tree method") {
+    huff::CodeLengths code_lengths = {};
+    code_lengths['a'] = 2;
+    code_lengths['b'] = 2;
+    code_lengths['c'] = 1;
+    huff::HuffTree huff_tree(code_lengths);
+    REQUIRE_NOTHROW(huff_tree.root());
+    REQUIRE_FALSE(huff_tree.root()->right() == nullptr);
+    CHECK_EQ(huff_tree.root()->left()->symbol(), 'c');
+    CHECK_EQ(huff_tree.root()->right()->left()->symbol(), 'a');
+    CHECK_EQ(huff_tree.root()->right()->right()->symbol(), 'b');
+    CHECK_EQ(huff_tree.code_lengths(), code_lengths);
+    code_lengths['d'] = 1;
+    CHECK_THROWS_WITH_AS(huff_tree.build_canonical_tree(code_lengths),
+                         "File format error!", std::runtime_error);
+  }
+
   SUBCASE("testing HuffTree::extract_codes method") {
-    std::map<char, uint32_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
+    std::map<char, uint64_t> amount_table = { {'a', 1}, {'b', 2}, {'c', 4} };
     huff::HuffTree huff_tree(amount_table);
     REQUIRE_NOTHROW(huff_tree.extract_codes());
     CHECK_EQ(huff_tree['a'].size, 2);
     CHECK_EQ(huff_tree['b'].size, 2);
     CHECK_EQ(huff_tree['c'].size, 1);
-    CHECK_EQ(huff_tree['a'].buffer[0], 0b00000000);
-    CHECK_EQ(huff_tree['b'].buffer[0], 0b00000010);
-    CHECK_EQ(huff_tree['c'].buffer[0], 0b00000001);
+    CHECK_EQ(huff_tree['a'].buffer[0], 0b00000001);
+    CHECK_EQ(huff_tree['b'].buffer[0], 0b00000011);
+    CHECK_EQ(huff_tree['c'].buffer[0], 0b00000000);
+  }
+}
+
+
+TEST_CASE("testing ThreadPool class") {
+  std::vector<std::future<int>> results;
+  {
+    huff::ThreadPool pool(3);
+    for (int i = 0; i < 100; ++i) {
+      results.push_back(pool.submit([i]() { return i * i; }));
+    }
+  }
+  for (int i = 0; i < 100; ++i) {
+    CHECK_EQ(results[i].get(), i * i);
+  }
+}
+
+
+TEST_CASE("testing MappedFile class") {
+  const std::string path = "mapped_file_test.tmp";
+  huff::MappedFile mapped_file;
+  CHECK_FALSE(mapped_file.open("no_such_file.tmp"));
+  CHECK_EQ(mapped_file.data(), nullptr);
+
+  SUBCASE("regular file") {
+    std::string content = "mapped\0file";
+    std::ofstream(path, std::ios::binary) << content;
+    REQUIRE(mapped_file.open(path));
+    REQUIRE_EQ(mapped_file.size(), content.size());
+    CHECK(std::equal(content.begin(), content.end(), mapped_file.data()));
+  }
+
+  SUBCASE("empty file") {
+    std::ofstream(path, std::ios::binary).close();
+    REQUIRE(mapped_file.open(path));
+    CHECK_EQ(mapped_file.size(), 0);
   }
+
+  mapped_file.close();
+  CHECK_EQ(mapped_file.size(), 0);
+  std::remove(path.c_str());
 }
 
 
@@ -232,28 +712,419 @@ TEST_CASE("testing HuffmanArchiver class") {
     CHECK_EQ(huffman_archiver.tree().root()->amount(), 7);
   }
 
+  SUBCASE("testing code length limit option") {
+    CHECK_EQ(huffman_archiver.max_code_length(),
+             huff::HuffmanArchiver::DEFAULT_MAX_CODE_LENGTH);
+    CHECK_THROWS_WITH_AS(huffman_archiver.max_code_length(7),
+                         "Wrong maximum code length!", std::runtime_error);
+    CHECK_THROWS_WITH_AS(huffman_archiver.max_code_length(57),
+                         "Wrong maximum code length!", std::runtime_error);
+    huffman_archiver.max_code_length(12);
+    CHECK_EQ(huffman_archiver.max_code_length(), 12);
+  }
+
+  SUBCASE("testing threads option") {
+    CHECK_EQ(huffman_archiver.threads(), 1);
+    huffman_archiver.threads(0);
+    CHECK_GE(huffman_archiver.threads(), 1);
+    CHECK_THROWS_WITH_AS(huffman_archiver.threads(1000),
+                         "Wrong number of threads!", std::runtime_error);
+  }
+
+  SUBCASE("testing streams option") {
+    CHECK_EQ(huffman_archiver.streams(), 1);
+    huffman_archiver.streams(4);
+    CHECK_EQ(huffman_archiver.streams(), 4);
+    CHECK_THROWS_WITH_AS(huffman_archiver.streams(0),
+                         "Wrong number of streams!", std::runtime_error);
+    CHECK_THROWS_WITH_AS(
+        huffman_archiver.streams(huff::HuffmanArchiver::MAX_STREAMS + 1),
+        "Wrong number of streams!", std::runtime_error);
+  }
+
+  SUBCASE("testing context tables option") {
+    CHECK_EQ(huffman_archiver.context_tables(), 0);
+    CHECK_THROWS_WITH_AS(
+        huffman_archiver.context_tables(
+            huff::HuffmanArchiver::MAX_CONTEXT_TABLES + 1),
+        "Wrong number of context tables!", std::runtime_error);
+
+    std::string test_str;
+    for (int i = 0; i < 20000; ++i) {
+      char previous = i ? test_str.back() : 'a';
+      test_str += static_cast<char>('a' + (previous * 5 + i % 3) % 16);
+    }
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(test_str.data());
+    std::ostringstream order0_str(std::ios::binary);
+    huffman_archiver.encode(data, test_str.size(), order0_str);
+
+    huffman_archiver.context_tables(16);
+    CHECK_EQ(huffman_archiver.context_tables(), 16);
+    std::ostringstream order1_str(std::ios::binary);
+    huffman_archiver.encode(data, test_str.size(), order1_str);
+    std::string encoded = order1_str.str();
+    CHECK_EQ(encoded[huff::HuffmanArchiver::FILE_HEADER_SIZE],
+             huff::HuffmanArchiver::HUFFMAN_ORDER1);
+    CHECK_LT(encoded.size(), order0_str.str().size() / 2);
+    CHECK_EQ(huffman_archiver.encoded_size(data, test_str.size()),
+             encoded.size());
+
+    std::istringstream decode_str(encoded, std::ios::binary);
+    std::ostringstream check_str(std::ios::binary);
+    huffman_archiver.decode(decode_str, check_str);
+    CHECK_EQ(check_str.str(), test_str);
+  }
+
+  SUBCASE("testing adaptive option") {
+    CHECK_FALSE(huffman_archiver.adaptive());
+    huffman_archiver.adaptive(true);
+    CHECK(huffman_archiver.adaptive());
+
+    std::string test_str;
+    for (int i = 0; i < 20000; ++i) {
+      test_str += static_cast<char>('a' + i * i % 11);
+    }
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(test_str.data());
+    std::ostringstream encoded_str(std::ios::binary);
+    huffman_archiver.encode(data, test_str.size(), encoded_str);
+    std::string encoded = encoded_str.str();
+    CHECK_EQ(encoded[huff::HuffmanArchiver::FILE_HEADER_SIZE],
+             huff::HuffmanArchiver::ADAPTIVE);
+    CHECK_EQ(huffman_archiver.encoded_size(data, test_str.size()),
+             encoded.size());
+    CHECK_EQ(huffman_archiver.stats().symbols, test_str.size());
+    CHECK_GE(huffman_archiver.stats().average_code_length(),
+             huffman_archiver.stats().entropy());
+
+    std::string uniform;
+    for (int i = 0; i < 5000; ++i) {
+      uniform += static_cast<char>(i * 7919 % 256);
+    }
+    data = reinterpret_cast<const uint8_t *>(uniform.data());
+    std::ostringstream stored_str(std::ios::binary);
+    huffman_archiver.encode(data, uniform.size(), stored_str);
+    CHECK_EQ(stored_str.str()[huff::HuffmanArchiver::FILE_HEADER_SIZE],
+             huff::HuffmanArchiver::STORED);
+    CHECK_EQ(huffman_archiver.encoded_size(data, uniform.size()),
+             stored_str.str().size());
+  }
+
+  SUBCASE("testing block size option") {
+    CHECK_EQ(huffman_archiver.block_size(),
+             huff::HuffmanArchiver::DEFAULT_BLOCK_SIZE);
+    CHECK_THROWS_WITH_AS(huffman_archiver.block_size(1023),
+                         "Wrong block size!", std::runtime_error);
+    huffman_archiver.block_size(1 << 17);
+    CHECK_EQ(huffman_archiver.block_size(), 1 << 17);
+  }
+
+  SUBCASE("testing stats method") {
+    huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+    std::string test_str(huff::HuffmanArchiver::MIN_BLOCK_SIZE, 'z');
+    for (int i = 0; i < 2000; ++i) {
+      test_str += static_cast<char>('a' + i * i % 11);
+    }
+    std::istringstream encode_str(test_str, std::ios::binary);
+    std::ostringstream encoded_str(std::ios::binary);
+    huffman_archiver.encode(encode_str, encoded_str);
+    huff::HuffmanArchiver::Stats stats = huffman_archiver.stats();
+    CHECK_EQ(stats.in_bytes, test_str.size());
+    CHECK_EQ(stats.out_bytes, encoded_str.str().size());
+    CHECK_EQ(stats.blocks, 3);
+    CHECK_EQ(stats.symbols, 2000);
+    CHECK_GE(stats.average_code_length(), stats.entropy());
+    CHECK_LT(stats.average_code_length(), stats.entropy() + 1);
+    CHECK_EQ(stats.max_code_length, 3);
+    CHECK_GE(stats.total_seconds, stats.histogram_seconds);
+
+    std::istringstream decode_str(encoded_str.str(), std::ios::binary);
+    std::ostringstream decoded_str(std::ios::binary);
+    huffman_archiver.decode(decode_str, decoded_str);
+    stats = huffman_archiver.stats();
+    CHECK_EQ(stats.in_bytes, encoded_str.str().size());
+    CHECK_EQ(stats.out_bytes, test_str.size());
+    CHECK_EQ(stats.blocks, 3);
+    CHECK_EQ(stats.symbols, 2000);
+    CHECK_EQ(stats.max_code_length, 3);
+    CHECK_EQ(stats.histogram_seconds, 0);
+  }
+
+  SUBCASE("testing table decoding on an archiver that has encoded") {
+    std::string first_str(3000, 'a');
+    std::string second_str;
+    for (int i = 0; i < 3000; ++i) {
+      first_str[i] = static_cast<char>('a' + i * i % 7);
+      second_str += static_cast<char>('k' + i * i % 13);
+    }
+    huff::HuffmanArchiver other_archiver;
+    std::istringstream second_in(second_str, std::ios::binary);
+    std::ostringstream second_archive(std::ios::binary);
+    other_archiver.encode(second_in, second_archive);
+
+    std::istringstream first_in(first_str, std::ios::binary);
+    std::ostringstream first_archive(std::ios::binary);
+    huffman_archiver.encode(first_in, first_archive);
+    huffman_archiver.decode_engine(huff::HuffmanArchiver::TABLE);
+    std::istringstream decode_str(second_archive.str(), std::ios::binary);
+    std::ostringstream check_str(std::ios::binary);
+    huffman_archiver.decode(decode_str, check_str);
+    CHECK_EQ(check_str.str(), second_str);
+
+    std::istringstream info_str(tree_info({ {'x', 1}, {'y', 1} }),
+                                std::ios::binary);
+    huffman_archiver.decode_buildHuffTree(info_str);
+    CHECK_EQ(huffman_archiver.tree().code_table().size('x'), 1);
+    CHECK_EQ(huffman_archiver.tree().code_table().size('a'), 0);
+  }
+
+  SUBCASE("testing encode method on a pipe") {
+    std::string test_str;
+    for (int i = 0; i < 3000; ++i) {
+      test_str += static_cast<char>('a' + i * i % 11);
+    }
+    huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+    std::istringstream file_str(test_str, std::ios::binary);
+    std::ostringstream expected_str(std::ios::binary);
+    long expected_info = huffman_archiver.encode(file_str, expected_str);
+
+    PipeBuf pipe_buf(test_str);
+    std::istream pipe_str(&pipe_buf);
+    std::ostringstream encoded_str(std::ios::binary);
+    CHECK_EQ(huffman_archiver.encode(pipe_str, encoded_str), expected_info);
+    CHECK_EQ(encoded_str.str(), expected_str.str());
+    CHECK_EQ(huffman_archiver.in_size(), test_str.size());
+    CHECK_EQ(huffman_archiver.out_size(), encoded_str.str().size());
+
+    // Adaptive blocks take what the pipe has at hand, 7 bytes at a time,
+    // instead of waiting for whole blocks.
+    huffman_archiver.adaptive(true);
+    huffman_archiver.threads(2);
+    PipeBuf adaptive_buf(test_str);
+    std::istream adaptive_str(&adaptive_buf);
+    std::ostringstream adaptive_encoded(std::ios::binary);
+    huffman_archiver.encode(adaptive_str, adaptive_encoded);
+    CHECK_EQ(huffman_archiver.stats().blocks, (test_str.size() + 6) / 7);
+    std::string archive = adaptive_encoded.str();
+    std::vector<uint8_t> decoded(test_str.size());
+    size_t decoded_size;
+    CHECK_EQ(huffman_archiver.decode(
+                 reinterpret_cast<const uint8_t *>(archive.data()),
+                 archive.size(), decoded.data(), decoded.size(), decoded_size),
+             huff::HuffmanArchiver::OK);
+    CHECK_EQ(std::string(decoded.begin(), decoded.end()), test_str);
+  }
+
+  SUBCASE("testing decode method on a pipe") {
+    std::string test_str;
+    for (int i = 0; i < 3000; ++i) {
+      test_str += static_cast<char>('a' + i * i % 11);
+    }
+    huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+    std::istringstream encode_str(test_str, std::ios::binary);
+    std::ostringstream encoded_str(std::ios::binary);
+    long info = huffman_archiver.encode(encode_str, encoded_str);
+
+    PipeBuf pipe_buf(encoded_str.str() + "tail");
+    std::istream pipe_str(&pipe_buf);
+    std::ostringstream decoded_str(std::ios::binary);
+    CHECK_EQ(huffman_archiver.decode(pipe_str, decoded_str), info);
+    CHECK_EQ(decoded_str.str(), test_str);
+    CHECK_EQ(huffman_archiver.in_size(), encoded_str.str().size());
+    CHECK_EQ(huffman_archiver.out_size(), test_str.size());
+    std::string rest;
+    pipe_str >> rest;
+    CHECK_EQ(rest, "tail");
+  }
+
+  SUBCASE("testing encode and decode methods on memory") {
+    std::string test_str;
+    for (int i = 0; i < 5000; ++i) {
+      test_str += static_cast<char>('a' + i * i % 13);
+    }
+    huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+    huffman_archiver.threads(2);
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(test_str.data());
+    std::istringstream encode_str(test_str, std::ios::binary);
+    std::ostringstream expected_str(std::ios::binary);
+    long info = huffman_archiver.encode(encode_str, expected_str);
+
+    std::ostringstream encoded_str(std::ios::binary);
+    CHECK_EQ(huffman_archiver.encode(data, test_str.size(), encoded_str), info);
+    CHECK_EQ(encoded_str.str(), expected_str.str());
+    CHECK_EQ(huffman_archiver.in_size(), test_str.size());
+
+    std::string archive = encoded_str.str();
+    data = reinterpret_cast<const uint8_t *>(archive.data());
+    std::ostringstream decoded_str(std::ios::binary);
+    CHECK_EQ(huffman_archiver.decode(data, archive.size(), decoded_str), info);
+    CHECK_EQ(decoded_str.str(), test_str);
+    CHECK_EQ(huffman_archiver.in_size(), archive.size());
+
+    for (size_t size : {size_t(3), archive.size() / 2, archive.size() - 1}) {
+      std::ostringstream out(std::ios::binary);
+      CHECK_THROWS_WITH_AS(huffman_archiver.decode(data, size, out),
+                           "File format error!", std::runtime_error);
+    }
+    std::ostringstream empty_str(std::ios::binary);
+    CHECK_EQ(huffman_archiver.decode(data, 0, empty_str), 0);
+    CHECK_EQ(huffman_archiver.encode(data, 0, empty_str), 0);
+    CHECK(empty_str.str().empty());
+  }
+
+  SUBCASE("testing encode and decode methods on buffers") {
+    std::string test_str;
+    for (int i = 0; i < 5000; ++i) {
+      test_str += static_cast<char>('a' + i * i % 17);
+    }
+    huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+    huffman_archiver.threads(3);
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(test_str.data());
+    std::ostringstream expected_str(std::ios::binary);
+    huffman_archiver.encode(data, test_str.size(), expected_str);
+    std::string expected = expected_str.str();
+
+    size_t bound = huffman_archiver.encode_bound(test_str.size());
+    CHECK_EQ(bound, 8 + 5 * 9 + 5000 + 1);
+    CHECK_EQ(huffman_archiver.encode_bound(0), 0);
+    std::vector<uint8_t> archive(bound);
+    size_t archive_size;
+    REQUIRE_EQ(huffman_archiver.encode(data, test_str.size(), archive.data(),
+                                       archive.size(), archive_size),
+               huff::HuffmanArchiver::OK);
+    CHECK_EQ(std::string(archive.begin(), archive.begin() + archive_size),
+             expected);
+    std::vector<uint8_t> small(archive_size - 1, 0xAA);
+    CHECK_EQ(huffman_archiver.encode(data, test_str.size(), small.data(),
+                                     small.size(), archive_size),
+             huff::HuffmanArchiver::BUFFER_TOO_SMALL);
+    CHECK_EQ(archive_size, 0);
+    CHECK_EQ(std::string(small.begin(), small.end()),
+             std::string(small.size(), '\xAA'));
+
+    huffman_archiver.adaptive(true);
+    std::ostringstream adaptive_str(std::ios::binary);
+    huffman_archiver.encode(data, test_str.size(), adaptive_str);
+    REQUIRE_EQ(huffman_archiver.encode(data, test_str.size(), archive.data(),
+                                       archive.size(), archive_size),
+               huff::HuffmanArchiver::OK);
+    CHECK_EQ(std::string(archive.begin(), archive.begin() + archive_size),
+             adaptive_str.str());
+    CHECK_EQ(huffman_archiver.encode(data, test_str.size(), archive.data(),
+                                     archive_size - 1, archive_size),
+             huff::HuffmanArchiver::BUFFER_TOO_SMALL);
+    huffman_archiver.adaptive(false);
+
+    archive.assign(expected.begin(), expected.end());
+    size_t raw_size;
+    CHECK_EQ(huff::HuffmanArchiver::decoded_size(
+                 archive.data(), archive.size(), raw_size),
+             huff::HuffmanArchiver::OK);
+    CHECK_EQ(raw_size, test_str.size());
+    std::vector<uint8_t> decoded(raw_size);
+    size_t decoded_size;
+    REQUIRE_EQ(huffman_archiver.decode(archive.data(), archive.size(),
+                                       decoded.data(), decoded.size(),
+                                       decoded_size),
+               huff::HuffmanArchiver::OK);
+    CHECK_EQ(decoded_size, test_str.size());
+    CHECK_EQ(std::string(decoded.begin(), decoded.end()), test_str);
+    CHECK_EQ(huffman_archiver.decode(archive.data(), archive.size(),
+                                     decoded.data(), decoded.size() - 1,
+                                     decoded_size),
+             huff::HuffmanArchiver::BUFFER_TOO_SMALL);
+    CHECK_EQ(huffman_archiver.decode(archive.data(), archive.size() - 1,
+                                     decoded.data(), decoded.size(),
+                                     decoded_size),
+             huff::HuffmanArchiver::FORMAT_ERROR);
+    CHECK_EQ(decoded_size, 0);
+
+    std::string corrupted = file_header() +
+                            block(huff::HuffmanArchiver::HUFFMAN, 20,
+                                  tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                                  static_cast<char>(0b10010110)) +
+                            end_block;
+    data = reinterpret_cast<const uint8_t *>(corrupted.data());
+    CHECK_EQ(huffman_archiver.decode(data, corrupted.size(), decoded.data(),
+                                     decoded.size(), decoded_size),
+             huff::HuffmanArchiver::FORMAT_ERROR);
+  }
+
+  SUBCASE("testing encoded_size method") {
+    huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+    std::string skewed, uniform;
+    uint32_t state = 1;
+    for (int i = 0; i < 4000; ++i) {
+      skewed += static_cast<char>('a' + i * i % 5 + i / 1024);
+      state = state * 1103515245 + 12345;
+      uniform += static_cast<char>(state >> 16);
+    }
+    for (uint8_t streams : {3, 1}) {
+      huffman_archiver.streams(streams);
+      for (const std::string &test_str :
+           {std::string(), std::string(3000, 'x'), skewed, uniform,
+            std::string(100, 'y') + uniform}) {
+        const uint8_t *data =
+            reinterpret_cast<const uint8_t *>(test_str.data());
+        std::ostringstream encoded_str(std::ios::binary);
+        huffman_archiver.encode(data, test_str.size(), encoded_str);
+        size_t size = huffman_archiver.encoded_size(data, test_str.size());
+        CHECK_EQ(size, encoded_str.str().size());
+        CHECK_LE(size, huffman_archiver.encode_bound(test_str.size()));
+      }
+    }
+
+    huffman_archiver.adaptive(true);
+    for (const std::string &test_str :
+         {std::string(3000, 'x'), skewed, uniform + skewed}) {
+      const uint8_t *data = reinterpret_cast<const uint8_t *>(test_str.data());
+      std::ostringstream encoded_str(std::ios::binary);
+      huffman_archiver.encode(data, test_str.size(), encoded_str);
+      CHECK_EQ(huffman_archiver.encoded_size(data, test_str.size()),
+               encoded_str.str().size());
+    }
+    // The second block goes on with the model the first one built.
+    std::string repeated = skewed.substr(0, 1024) + skewed.substr(0, 1024);
+    std::ostringstream repeated_str(std::ios::binary);
+    huffman_archiver.encode(reinterpret_cast<const uint8_t *>(repeated.data()),
+                            repeated.size(), repeated_str);
+    std::string archive = repeated_str.str();
+    uint32_t first_size, second_size;
+    memcpy(&first_size, &archive[8 + 5], sizeof first_size);
+    memcpy(&second_size, &archive[8 + 9 + first_size + 5], sizeof second_size);
+    CHECK_EQ(archive[8], huff::HuffmanArchiver::ADAPTIVE);
+    CHECK_LT(second_size, first_size);
+    huffman_archiver.adaptive(false);
+
+    uint32_t counts[256] = {};
+    counts['a'] = 1000;
+    CHECK_EQ(huffman_archiver.block_encoded_size(counts),
+             huff::HuffmanArchiver::BLOCK_HEADER_SIZE + 1);
+    counts['b'] = 24;
+    CHECK_EQ(huffman_archiver.block_encoded_size(counts),
+             huff::HuffmanArchiver::BLOCK_HEADER_SIZE + 1 + 128 + 128);
+    counts['c'] = 1;
+    CHECK_THROWS_AS(huffman_archiver.block_encoded_size(counts),
+                    std::logic_error);
+  }
+
   SUBCASE("testing decode_buildHuffTree method") {
-    std::string test_str{2, 'a', 1, 0, 0, 0,
-                            'b', 2, 0, 0, 0,
-                            'c', 4, 0, 0, 0};
+    std::string test_str = tree_info({ {'a', 2}, {'b', 2}, {'c', 1} });
     std::istringstream decode_str(test_str, std::ios::binary);
-    std::cout << std::endl;
     REQUIRE_NOTHROW(huffman_archiver.decode_buildHuffTree(decode_str));
     REQUIRE_NOTHROW(huffman_archiver.tree().root());
     REQUIRE_FALSE(huffman_archiver.tree().root()->left() == nullptr);
-    REQUIRE_FALSE(huffman_archiver.tree().root()->left()->left() == nullptr);
-    REQUIRE_FALSE(huffman_archiver.tree().root()->left()->right() == nullptr);
     REQUIRE_FALSE(huffman_archiver.tree().root()->right() == nullptr);
-    huff::TreeNode a_node('a', 1);
-    huff::TreeNode b_node('b', 2);
-    huff::TreeNode c_node('c', 4);
+    REQUIRE_FALSE(huffman_archiver.tree().root()->right()->left() == nullptr);
+    REQUIRE_FALSE(huffman_archiver.tree().root()->right()->right() == nullptr);
+    huff::TreeNode a_node('a', 0);
+    huff::TreeNode b_node('b', 0);
+    huff::TreeNode c_node('c', 0);
     a_node.used(true);
     b_node.used(true);
     c_node.used(true);
-    CHECK_EQ(*huffman_archiver.tree().root()->left()->left(), a_node);
-    CHECK_EQ(*huffman_archiver.tree().root()->left()->right(), b_node);
-    CHECK_EQ(*huffman_archiver.tree().root()->right(), c_node);
-    CHECK_EQ(huffman_archiver.tree().root()->amount(), 7);
+    CHECK_EQ(*huffman_archiver.tree().root()->right()->left(), a_node);
+    CHECK_EQ(*huffman_archiver.tree().root()->right()->right(), b_node);
+    CHECK_EQ(*huffman_archiver.tree().root()->left(), c_node);
   }
 
   SUBCASE("testing decode_buildHuffTree method on an empty file") {
@@ -265,7 +1136,8 @@ TEST_CASE("testing HuffmanArchiver class") {
   }
 
   SUBCASE("testing decode_buildHuffTree method on a corrupted file") {
-    std::string test_str = {2, 'a', 1, 0, 0, 0, 'b', '~', '~'};
+    std::string test_str = tree_info({ {'a', 2}, {'b', 2}, {'c', 1} });
+    test_str.resize(64);
     std::istringstream decode_str(test_str, std::ios::binary);
     CHECK_THROWS_WITH_AS(huffman_archiver.decode_buildHuffTree(decode_str),
                          "File format error!", std::runtime_error);
@@ -277,29 +1149,45 @@ TEST_CASE("testing HuffmanArchiver class") {
     std::string compare_str;
 
     SUBCASE("state situation") {
-      test_str = "cbcacbc";
-      compare_str = {2, 'a', 1, 0, 0, 0,
-                        'b', 2, 0, 0, 0,
-                        'c', 4, 0, 0, 0, 2,
-                     static_cast<char>(0b01001101),
-                     static_cast<char>(0b00000011)};
+      std::string payload(40, 0);
+      const int pattern[] = {0, 1, 1, 0, 1, 0, 0, 1, 1, 0};
+      for (int i = 0; i < 32; ++i) {
+        test_str += "cbcacbc";
+        for (int j = 0; j < 10; ++j) {
+          payload[(i * 10 + j) / 8] |= pattern[j] << (i * 10 + j) % 8;
+        }
+      }
+      compare_str = file_header() +
+                    block(huff::HuffmanArchiver::HUFFMAN, 224,
+                          tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                          payload) +
+                    end_block;
     }
 
     SUBCASE("file which consists of one repeating character") {
       test_str = "aaaaaaaaaa";
-      compare_str = {0, 'a', 0xA, 0, 0, 0};
+      compare_str = file_header() +
+                    block(huff::HuffmanArchiver::RLE, 10, "a") + end_block;
     }
 
-    SUBCASE("file which consists of one repeating character") {
+    SUBCASE("empty file") {
       test_str = {};
       compare_str = {};
     }
 
-    SUBCASE("file which size (in bits) is divisible by 8") {
+    SUBCASE("file too small to be shrunk by Huffman coding") {
       test_str = "aaaabbbb";
-      compare_str = {1, 'a', 4, 0, 0, 0,
-                        'b', 4, 0, 0, 0, 0,
-                     static_cast<char>(0b11110000)};
+      compare_str = file_header() +
+                    block(huff::HuffmanArchiver::STORED, 8, "aaaabbbb") +
+                    end_block;
+    }
+
+    SUBCASE("file split into several blocks") {
+      huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+      test_str = std::string(1024, 'a') + std::string(1000, 'b');
+      compare_str = file_header(1024) +
+                    block(huff::HuffmanArchiver::RLE, 1024, "a") +
+                    block(huff::HuffmanArchiver::RLE, 1000, "b") + end_block;
     }
 
     std::istringstream encode_str(test_str, std::ios::binary);
@@ -313,19 +1201,145 @@ TEST_CASE("testing HuffmanArchiver class") {
     std::string compare_str;
 
     SUBCASE("state situation") {
-      test_str = {2, 'a', 1, 0, 0, 0,
-                     'b', 2, 0, 0, 0,
-                     'c', 4, 0, 0, 0, 2,
-                     static_cast<char>(0b01001101),
-                     static_cast<char>(0b00000011)};
-      compare_str = "cbcacbc";
+      test_str = file_header() +
+                 block(huff::HuffmanArchiver::HUFFMAN, 7,
+                       tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                       static_cast<char>(0b10010110) +
+                       static_cast<char>(0b00000001)) +
+                 block(huff::HuffmanArchiver::STORED, 3, "xyz") +
+                 end_block;
+      compare_str = "cbcacbcxyz";
     }
 
     SUBCASE("file which consists of one repeating character") {
-      test_str = {0, 'a', 10, 0, 0, 0};
+      test_str = file_header() + block(huff::HuffmanArchiver::RLE, 10, "a") +
+                 end_block;
       compare_str = "aaaaaaaaaa";
     }
 
+    SUBCASE("block split into streams") {
+      test_str = file_header() +
+                 block(huff::HuffmanArchiver::HUFFMAN_STREAMS, 7,
+                       tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                       static_cast<char>(2) + u32(1) +
+                       static_cast<char>(0b00010110) +
+                       static_cast<char>(0b00000110)) +
+                 end_block;
+      compare_str = "cbcacbc";
+    }
+
+    SUBCASE("blocks decoded on several threads") {
+      huffman_archiver.threads(3);
+      test_str = file_header();
+      for (int i = 0; i < 10; ++i) {
+        test_str +=
+            block(huff::HuffmanArchiver::RLE, 5, std::string(1, 'a' + i));
+        compare_str += std::string(5, 'a' + i);
+      }
+      test_str += end_block;
+    }
+
+    SUBCASE("corrupted files") {
+      std::string huffman_block =
+          block(huff::HuffmanArchiver::HUFFMAN, 7,
+                tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                static_cast<char>(0b10010110) +
+                static_cast<char>(0b00000001));
+
+      SUBCASE("truncated block") {
+        test_str = file_header() +
+                   huffman_block.substr(0, huffman_block.size() - 1);
+      }
+      SUBCASE("missing END block") {
+        test_str = file_header() + huffman_block;
+      }
+      SUBCASE("payload shorter than the symbol count") {
+        test_str = file_header() +
+                   block(huff::HuffmanArchiver::HUFFMAN, 20,
+                         tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                         static_cast<char>(0b10010110) +
+                         static_cast<char>(0b00000001)) +
+                   end_block;
+      }
+      SUBCASE("payload shorter than the symbol count, table decoder") {
+        huffman_archiver.decode_engine(huff::HuffmanArchiver::TABLE);
+        test_str = file_header() +
+                   block(huff::HuffmanArchiver::HUFFMAN, 20,
+                         tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                         static_cast<char>(0b10010110)) +
+                   end_block;
+      }
+      SUBCASE("streams shorter than their symbols, table decoder") {
+        huffman_archiver.decode_engine(huff::HuffmanArchiver::TABLE);
+        test_str = file_header() +
+                   block(huff::HuffmanArchiver::HUFFMAN_STREAMS, 40,
+                         tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                         static_cast<char>(2) + u32(1) +
+                         static_cast<char>(0) + static_cast<char>(0)) +
+                   end_block;
+      }
+      SUBCASE("block larger than the block size") {
+        test_str = file_header(1024) +
+                   block(huff::HuffmanArchiver::RLE, 1025, "a") + end_block;
+      }
+      SUBCASE("corrupted block decoded on a worker thread") {
+        huffman_archiver.threads(4);
+        test_str = file_header() + huffman_block +
+                   block(huff::HuffmanArchiver::HUFFMAN, 20,
+                         tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                         static_cast<char>(0b10010110)) +
+                   end_block;
+      }
+      SUBCASE("wrong stream count") {
+        test_str = file_header() +
+                   block(huff::HuffmanArchiver::HUFFMAN_STREAMS, 7,
+                         tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                         static_cast<char>(1) +
+                         static_cast<char>(0b10010110) +
+                         static_cast<char>(0b00000001)) +
+                   end_block;
+      }
+      SUBCASE("stream larger than the block") {
+        test_str = file_header() +
+                   block(huff::HuffmanArchiver::HUFFMAN_STREAMS, 7,
+                         tree_info({ {'a', 2}, {'b', 2}, {'c', 1} }) +
+                         static_cast<char>(2) + u32(3) +
+                         static_cast<char>(0b00010110) +
+                         static_cast<char>(0b00000110)) +
+                   end_block;
+      }
+      SUBCASE("wrong context table count") {
+        test_str = file_header() +
+                   block(huff::HuffmanArchiver::HUFFMAN_ORDER1, 7,
+                         std::string(1 + 128, 0)) +
+                   end_block;
+      }
+      SUBCASE("context mapped to a missing table") {
+        test_str = file_header() +
+                   block(huff::HuffmanArchiver::HUFFMAN_ORDER1, 7,
+                         static_cast<char>(1) + std::string(1 + 128, 1)) +
+                   end_block;
+      }
+      SUBCASE("adaptive block no smaller than its data") {
+        test_str = file_header() +
+                   block(huff::HuffmanArchiver::ADAPTIVE, 2, "ab") +
+                   end_block;
+      }
+      SUBCASE("adaptive payload shorter than the symbol count") {
+        test_str = file_header() +
+                   block(huff::HuffmanArchiver::ADAPTIVE, 20, "a") +
+                   end_block;
+      }
+      SUBCASE("wrong magic") {
+        test_str = "HUG" + file_header().substr(3) + end_block;
+      }
+
+      std::istringstream decode_str(test_str, std::ios::binary);
+      CHECK_THROWS_WITH_AS(huffman_archiver.decode(decode_str, out),
+                           "File format error!", std::runtime_error);
+      return;
+    }
+
     SUBCASE("empty file") {
       test_str = {};
       compare_str = {};
@@ -350,13 +1364,87 @@ TEST_CASE("testing HuffmanArchiver class") {
     SUBCASE("possible last-byte-missing error") {
       test_str = "aaaabbbb";
     }
-    std::istringstream encode_str(test_str, std::ios::binary);
-    std::ostringstream encoded_str(std::ios::binary);
-    std::istringstream decode_str(std::ios::binary);
-    std::ostringstream check_str(std::ios::binary);
-    REQUIRE_NOTHROW(huffman_archiver.encode(encode_str, encoded_str));
-    decode_str.str(encoded_str.str());
-    REQUIRE_NOTHROW(huffman_archiver.decode(decode_str, check_str));
-    CHECK_EQ(test_str, check_str.str());
+    SUBCASE("codes longer than the decode table width") {
+      uint32_t amount[2] = {1, 1};
+      for (char symbol = 'a'; symbol < 'p'; ++symbol) {
+        test_str += std::string(amount[0], symbol);
+        amount[0] += amount[1];
+        std::swap(amount[0], amount[1]);
+      }
+    }
+
+    SUBCASE("file split into several blocks") {
+      huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+      for (int i = 0; i < 5000; ++i) {
+        test_str += static_cast<char>('a' + i * i % 7 + i / 1000 * 3);
+      }
+    }
+
+    SUBCASE("blocks coded on several threads") {
+      huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+      huffman_archiver.threads(4);
+      for (int i = 0; i < 20000; ++i) {
+        test_str += static_cast<char>('a' + i * i % 7 + i / 1000);
+      }
+    }
+
+    SUBCASE("blocks split into streams") {
+      huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+      huffman_archiver.streams(4);
+      for (int i = 0; i < 5000; ++i) {
+        test_str += static_cast<char>('a' + i * i % 13 + i / 1000);
+      }
+    }
+
+    SUBCASE("streams longer than the block") {
+      huffman_archiver.streams(huff::HuffmanArchiver::MAX_STREAMS);
+      test_str = "abcab";
+    }
+
+    SUBCASE("blocks coded with an order-1 model") {
+      huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+      huffman_archiver.context_tables(
+          huff::HuffmanArchiver::MAX_CONTEXT_TABLES);
+      test_str = "b";
+      for (int i = 0; i < 5000; ++i) {
+        test_str += static_cast<char>(test_str.back() * 7 % 26 + 'a' +
+                                      (i % 11 == 0));
+      }
+    }
+
+    SUBCASE("blocks coded with adaptive codes") {
+      huffman_archiver.block_size(huff::HuffmanArchiver::MIN_BLOCK_SIZE);
+      huffman_archiver.adaptive(true);
+      huffman_archiver.threads(2);
+      for (int i = 0; i < 5000; ++i) {
+        test_str += static_cast<char>('a' + i * i % 13 + i / 1000);
+      }
+    }
+
+    SUBCASE("codes limited to the shortest allowed length") {
+      huffman_archiver.max_code_length(huff::HuffTree::MIN_LENGTH_LIMIT);
+      uint32_t amount[2] = {1, 1};
+      for (char symbol = 'a'; symbol < 'z'; ++symbol) {
+        test_str += std::string(amount[0], symbol);
+        amount[0] += amount[1];
+        std::swap(amount[0], amount[1]);
+      }
+    }
+
+    for (auto engine : {huff::HuffmanArchiver::TREE_WALK,
+                        huff::HuffmanArchiver::TABLE,
+                        huff::HuffmanArchiver::MULTI_SYMBOL,
+                        huff::HuffmanArchiver::AUTO,
+                        huff::HuffmanArchiver::BYTE_TABLE}) {
+      std::istringstream encode_str(test_str, std::ios::binary);
+      std::ostringstream encoded_str(std::ios::binary);
+      std::istringstream decode_str(std::ios::binary);
+      std::ostringstream check_str(std::ios::binary);
+      huffman_archiver.decode_engine(engine);
+      REQUIRE_NOTHROW(huffman_archiver.encode(encode_str, encoded_str));
+      decode_str.str(encoded_str.str());
+      REQUIRE_NOTHROW(huffman_archiver.decode(decode_str, check_str));
+      CHECK_EQ(test_str, check_str.str());
+    }
   }
 }